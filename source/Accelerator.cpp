@@ -0,0 +1,13 @@
+#include "Accelerator.hpp"
+
+void Accelerator::findNearestIntersections(const RayPacket &packet, const Frustum &,
+                                           RayPacketHits &hits) const {
+    for (unsigned int i = 0; i < packet.cnt; i++)
+        hits.hit[i] =
+            findNearestIntersection(packet.getRay(i), hits.t[i], hits.n[i], hits.trianIdx[i]);
+}
+
+void Accelerator::isObstructed(const Ray *rays, unsigned int cnt, bool *obstructed) const {
+    for (unsigned int i = 0; i < cnt; i++)
+        obstructed[i] = isObstructed(rays[i]);
+}
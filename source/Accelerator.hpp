@@ -0,0 +1,60 @@
+#pragma once
+
+#include "Frustum.hpp"
+#include "Ray.hpp"
+#include "RayPacket.hpp"
+
+#include <glm/glm.hpp>
+
+#include <ostream>
+
+enum class AcceleratorType {
+    /* KDTree over all triangles. */
+    KDTree,
+    /* TwoLevelKDTree, a KDTree for every mesh. */
+    TwoLevelKDTree,
+    /* Binary BVH. */
+    BVH,
+    /* WideBVH, a BVH with simdWidth children per node. */
+    WideBVH,
+    /* QuantizedWideBVH, a WideBVH with children's bounds quantized to bytes. */
+    QuantizedWideBVH
+};
+
+/**
+ * @brief Acceleration structure answering ray queries against a scene's triangles. Structures
+ * are built by their constructors and refer to triangles and vertices they were built for, which
+ * have to outlive them.
+ */
+class Accelerator {
+public:
+    virtual ~Accelerator() = default;
+    /**
+     * @brief Find the closest hit with t in (r.tMin, r.tMax).
+     * @param n Set to the normal interpolated from the hit triangle's vertices.
+     * @param trianIdx Set to index of the hit triangle in the scene's triangles.
+     */
+    virtual bool findNearestIntersection(const Ray &r, float &t, glm::vec3 &n,
+                                         unsigned int &trianIdx) const = 0;
+    /**
+     * @brief Same as above for every ray of the packet, which lies inside the frustum. Rays are
+     * traced one by one unless the structure traces packets itself, so only such structures use
+     * the frustum.
+     */
+    virtual void findNearestIntersections(const RayPacket &packet, const Frustum &frustum,
+                                          RayPacketHits &hits) const;
+    /**
+     * @brief Any-hit query for the segment between r.o + r.tMin * r.d and r.o + r.tMax * r.d.
+     * Surfaces at the segment's ends do not obstruct it.
+     */
+    virtual bool isObstructed(const Ray &r) const = 0;
+    /**
+     * @brief Any-hit query for a batch of segments.
+     * @param obstructed Array of cnt elements. i-th is set to the result for rays[i].
+     */
+    virtual void isObstructed(const Ray *rays, unsigned int cnt, bool *obstructed) const;
+    /**
+     * @brief Print a summary of the structure's quality and memory footprint.
+     */
+    virtual void printStats(std::ostream &os) const = 0;
+};
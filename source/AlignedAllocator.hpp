@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+
+/**
+ * @brief Allocator for containers whose storage has to start at given alignment, e.g. at cache
+ * line boundary.
+ */
+template <typename T, std::size_t alignment> struct AlignedAllocator {
+    typedef T value_type;
+    template <typename U> struct rebind {
+        typedef AlignedAllocator<U, alignment> other;
+    };
+
+    AlignedAllocator() = default;
+    template <typename U> AlignedAllocator(const AlignedAllocator<U, alignment> &) {}
+
+    T *allocate(std::size_t n) {
+        return static_cast<T *>(::operator new(n * sizeof(T), std::align_val_t(alignment)));
+    }
+    void deallocate(T *p, std::size_t n) { ::operator delete(p, std::align_val_t(alignment)); }
+
+    template <typename U> bool operator==(const AlignedAllocator<U, alignment> &) const {
+        return true;
+    }
+    template <typename U> bool operator!=(const AlignedAllocator<U, alignment> &) const {
+        return false;
+    }
+};
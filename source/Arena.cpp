@@ -0,0 +1,34 @@
+#include "Arena.hpp"
+
+#include <algorithm>
+
+void *Arena::allocate(std::size_t size, std::size_t alignment) {
+    if (!chunks.empty()) {
+        std::size_t offset = (top.offset + alignment - 1) / alignment * alignment;
+        if (offset + size <= chunks[top.chunkIdx].size) {
+            top.offset = offset + size;
+            return chunks[top.chunkIdx].data.get() + offset;
+        }
+        top.chunkIdx++;
+    }
+
+    // Chunks' storage is aligned for any type, so allocation starts at their beginning.
+    if (top.chunkIdx == chunks.size() || chunks[top.chunkIdx].size < size) {
+        chunks.resize(top.chunkIdx);
+        std::size_t chunkSize = std::max(minChunkSize, size);
+        chunks.push_back({std::unique_ptr<char[]>(new char[chunkSize]), chunkSize});
+        chunksSize += chunkSize;
+    }
+    top.offset = size;
+    return chunks[top.chunkIdx].data.get();
+}
+
+Arena::Mark Arena::mark() const { return top; }
+
+void Arena::release(const Mark &mark) {
+    top = mark;
+    if (chunks.size() > top.chunkIdx + 2)
+        chunks.resize(top.chunkIdx + 2);
+}
+
+std::size_t Arena::getChunksSize() const { return chunksSize; }
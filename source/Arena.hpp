@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+/**
+ * @brief Stack of memory allocated by bumping a pointer inside big chunks, for scratch data with
+ * nested lifetimes. Nothing is freed individually. Instead, everything allocated after a mark is
+ * released at once. Chunks left unused by a release are returned to the system, except for one
+ * kept for the following allocations.
+ */
+class Arena {
+public:
+    /* Position in the arena. */
+    struct Mark {
+        std::size_t chunkIdx = 0;
+        std::size_t offset = 0;
+    };
+
+    static constexpr std::size_t minChunkSize = 1 << 20;
+
+    Arena() = default;
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+    Arena(Arena &&) = default;
+    Arena &operator=(Arena &&) = default;
+
+    void *allocate(std::size_t size, std::size_t alignment);
+    Mark mark() const;
+    /**
+     * @brief Release everything allocated since mark was taken.
+     */
+    void release(const Mark &mark);
+    /**
+     * @return Number of bytes of all chunks allocated from the system so far.
+     */
+    std::size_t getChunksSize() const;
+
+private:
+    struct Chunk {
+        std::unique_ptr<char[]> data;
+        std::size_t size;
+    };
+
+    std::vector<Chunk> chunks;
+    Mark top;
+    std::size_t chunksSize = 0;
+};
+
+/**
+ * @brief Allocator for containers living in an arena. Deallocation is a no-op, memory is reclaimed
+ * by releasing the arena.
+ */
+template <typename T> struct ArenaAllocator {
+    typedef T value_type;
+    // Containers assigned to adopt the arena of the source.
+    typedef std::true_type propagate_on_container_copy_assignment;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    Arena *arena = nullptr;
+
+    ArenaAllocator() = default;
+    ArenaAllocator(Arena &arena) : arena(&arena) {}
+    template <typename U> ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.arena) {}
+
+    T *allocate(std::size_t n) {
+        return static_cast<T *>(arena->allocate(n * sizeof(T), alignof(T)));
+    }
+    void deallocate(T *p, std::size_t n) {}
+
+    template <typename U> bool operator==(const ArenaAllocator<U> &other) const {
+        return arena == other.arena;
+    }
+    template <typename U> bool operator!=(const ArenaAllocator<U> &other) const {
+        return arena != other.arena;
+    }
+};
+
+/* Vectors in arenas are meant to be reserved once to their final size. Growing leaves old storage
+ * behind until the arena is released. */
+template <typename T> using ArenaVector = std::vector<T, ArenaAllocator<T>>;
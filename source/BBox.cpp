@@ -1,5 +1,9 @@
 #include "BBox.hpp"
 
+#include <algorithm>
+#include <limits>
+#include <utility>
+
 BBox::BBox() : axesBounds({glm::vec2(0), glm::vec2(0), glm::vec2(0)}) {}
 
 BBox::BBox(const std::array<glm::vec2, 3> &axesBounds) : axesBounds(axesBounds) {}
@@ -51,3 +55,72 @@ float BBox::surfaceArea() const {
     return 2.f * (dimLength(0) * dimLength(1) + dimLength(0) * dimLength(2) +
                   dimLength(1) * dimLength(2));
 }
+
+bool BBox::intersect(const Ray &r, float &tMin, float &tMax) const {
+    // https://pbr-book.org/3ed-2018/Shapes/Basic_Shape_Interface#RayndashBoundsIntersections
+    float t0 = r.tMin, t1 = r.tMax;
+    for (unsigned int i = 0; i < 3; i++) {
+        float invRayDir = 1.f / r.d[i];
+        float tNear = (axesBounds[i][0] - r.o[i]) * invRayDir;
+        float tFar = (axesBounds[i][1] - r.o[i]) * invRayDir;
+        if (tNear > tFar)
+            std::swap(tNear, tFar);
+        // Make tFar more conservative to account for floating-point error.
+        tFar *= 1.f + 3.f * std::numeric_limits<float>::epsilon();
+        // Comparisons are written so that NaNs (ray parallel to and lying on a slab plane)
+        // leave the range untouched.
+        t0 = tNear > t0 ? tNear : t0;
+        t1 = tFar < t1 ? tFar : t1;
+        if (t0 > t1)
+            return false;
+    }
+    tMin = t0;
+    tMax = t1;
+    return true;
+}
+
+bool BBox::clipTriangle(const Triangle &t, const std::vector<Vertex> &vertices,
+                        BBox &clipped) const {
+    // Sutherland-Hodgman clipping against box's planes. Each plane adds at most one vertex.
+    std::array<glm::vec3, 9> polygon, clippedPolygon;
+    unsigned int polygonSize = 3;
+    for (unsigned int i = 0; i < 3; i++)
+        polygon[i] = vertices.at(t.indices[i]).pos;
+    for (unsigned int axis = 0; axis < 3; axis++)
+        for (unsigned int side = 0; side < 2; side++) {
+            float plane = axesBounds[axis][side];
+            // Non-negative for points inside the box.
+            auto dist = [&](const glm::vec3 &p) {
+                return side == 0 ? p[axis] - plane : plane - p[axis];
+            };
+            unsigned int clippedSize = 0;
+            for (unsigned int i = 0; i < polygonSize; i++) {
+                const glm::vec3 &a = polygon[i], &b = polygon[(i + 1) % polygonSize];
+                float distA = dist(a), distB = dist(b);
+                if (distA >= 0.f)
+                    clippedPolygon[clippedSize++] = a;
+                if ((distA < 0.f && distB > 0.f) || (distA > 0.f && distB < 0.f)) {
+                    glm::vec3 p = a + (b - a) * (distA / (distA - distB));
+                    p[axis] = plane;
+                    clippedPolygon[clippedSize++] = p;
+                }
+            }
+            polygon.swap(clippedPolygon);
+            polygonSize = clippedSize;
+            if (polygonSize == 0)
+                return false;
+        }
+
+    clipped = BBox(std::array<glm::vec2, 3>{glm::vec2(polygon[0].x), glm::vec2(polygon[0].y),
+                                            glm::vec2(polygon[0].z)});
+    for (unsigned int i = 1; i < polygonSize; i++)
+        for (unsigned int axis = 0; axis < 3; axis++) {
+            clipped.axesBounds[axis][0] = std::min(clipped.axesBounds[axis][0], polygon[i][axis]);
+            clipped.axesBounds[axis][1] = std::max(clipped.axesBounds[axis][1], polygon[i][axis]);
+        }
+    // Rounding errors may put intersection points slightly outside the box.
+    for (unsigned int axis = 0; axis < 3; axis++)
+        clipped.axesBounds[axis] = glm::clamp(clipped.axesBounds[axis], axesBounds[axis][0],
+                                              axesBounds[axis][1]);
+    return true;
+}
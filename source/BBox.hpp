@@ -1,6 +1,7 @@
 #pragma once
 
 #include "Mesh.hpp"
+#include "Ray.hpp"
 
 #include <glm/glm.hpp>
 
@@ -24,4 +25,18 @@ public:
     void replaceLower(unsigned int dim, float v);
     void replaceUpper(unsigned int dim, float v);
     float surfaceArea() const;
+    /**
+     * @brief Clip ray's parametric range to the box.
+     * @param tMin Set to the parametric distance at which ray enters the box (or ray.tMin).
+     * @param tMax Set to the parametric distance at which ray leaves the box (or ray.tMax).
+     * @return false if ray misses the box.
+     */
+    bool intersect(const Ray &r, float &tMin, float &tMax) const;
+    /**
+     * @brief Find bounds of the part of the triangle lying inside the box.
+     * @param clipped Set to the found bounds, which never exceed the box.
+     * @return false if the triangle misses the box.
+     */
+    bool clipTriangle(const Triangle &t, const std::vector<Vertex> &vertices,
+                      BBox &clipped) const;
 };
@@ -0,0 +1,902 @@
+#include "BVH.hpp"
+
+#include "KDTree.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <limits>
+#include <numeric>
+#include <thread>
+#include <utility>
+
+/**
+ * @brief Split [0, cnt) into chunksCnt contiguous chunks and call f(chunk, begin, end) for each of
+ * them in a thread of its own. Chunks are the same for the same cnt and chunksCnt.
+ */
+template <typename F>
+static void parallelFor(unsigned int cnt, unsigned int chunksCnt, const F &f) {
+    auto chunkBegin = [&](unsigned int chunk) {
+        return (unsigned int)((unsigned long long)cnt * chunk / chunksCnt);
+    };
+    std::vector<std::thread> threads;
+    for (unsigned int chunk = 1; chunk < chunksCnt; chunk++)
+        threads.emplace_back(f, chunk, chunkBegin(chunk), chunkBegin(chunk + 1));
+    f(0, 0, chunkBegin(1));
+    for (std::thread &t : threads)
+        t.join();
+}
+
+/**
+ * @brief Call f(i) for every i in [0, cnt) with threadsCnt threads taking indices one by one.
+ */
+template <typename F>
+static void parallelForEach(unsigned int cnt, unsigned int threadsCnt, const F &f) {
+    std::atomic<unsigned int> next = 0;
+    auto work = [&]() {
+        for (unsigned int i = next++; i < cnt; i = next++)
+            f(i);
+    };
+    std::vector<std::thread> threads;
+    for (unsigned int i = 1; i < std::min(threadsCnt, cnt); i++)
+        threads.emplace_back(work);
+    work();
+    for (std::thread &t : threads)
+        t.join();
+}
+
+/**
+ * @return x with two zero bits inserted after each of its lowest 10 bits.
+ */
+static std::uint32_t spreadBits(std::uint32_t x) {
+    x = (x | (x << 16)) & 0x030000FF;
+    x = (x | (x << 8)) & 0x0300F00F;
+    x = (x | (x << 4)) & 0x030C30C3;
+    x = (x | (x << 2)) & 0x09249249;
+    return x;
+}
+
+static BBox pointBounds(const glm::vec3 &p) {
+    return BBox(glm::vec2(p.x), glm::vec2(p.y), glm::vec2(p.z));
+}
+
+/**
+ * @brief Split a convex polygon by the plane p[axis] = plane, see BBox::clipTriangle.
+ * @param below Set to the part of the polygon with p[axis] <= plane.
+ * @param above Set to the part of the polygon with p[axis] >= plane.
+ */
+static void splitPolygon(const std::vector<glm::vec3> &polygon, unsigned int axis, float plane,
+                         std::vector<glm::vec3> &below, std::vector<glm::vec3> &above) {
+    below.clear();
+    above.clear();
+    for (unsigned int i = 0; i < polygon.size(); i++) {
+        const glm::vec3 &a = polygon[i], &b = polygon[(i + 1) % polygon.size()];
+        float distA = a[axis] - plane, distB = b[axis] - plane;
+        if (distA <= 0.f)
+            below.push_back(a);
+        if (distA >= 0.f)
+            above.push_back(a);
+        if ((distA < 0.f && distB > 0.f) || (distA > 0.f && distB < 0.f)) {
+            glm::vec3 p = a + (b - a) * (distA / (distA - distB));
+            p[axis] = plane;
+            below.push_back(p);
+            above.push_back(p);
+        }
+    }
+}
+
+static glm::vec3 boundsCenter(const BBox &bounds) {
+    glm::vec3 center;
+    for (unsigned int axis = 0; axis < 3; axis++)
+        center[axis] = (bounds.axesBounds[axis][0] + bounds.axesBounds[axis][1]) / 2.f;
+    return center;
+}
+
+/**
+ * @return Bin of ref's center among BVH::binsCnt equal bins of centers' bounds along axis.
+ */
+static unsigned int objectBin(const BVHBuildRef &ref, const BBox &centers, unsigned int axis) {
+    float scale = BVH::binsCnt / centers.dimLength(axis);
+    return std::min(BVH::binsCnt - 1,
+                    (unsigned int)((ref.center[axis] - centers.axesBounds[axis][0]) * scale));
+}
+
+BVH::BVH(const std::vector<Triangle> &triangles, const std::vector<Vertex> &vertices,
+         BVHBuild build, unsigned int buildThreads)
+    : triangles(triangles), vertices(vertices), rayRangeBias(0.f) {
+    if (triangles.empty())
+        return;
+    buildThreads = std::max(1u, buildThreads);
+    unsigned int chunksCnt =
+        std::max(1u, std::min<unsigned int>(buildThreads, triangles.size() / minParallelChunk));
+    std::vector<BVHBuildRef> refs(triangles.size());
+    parallelFor(refs.size(), chunksCnt, [&](unsigned int, unsigned int begin, unsigned int end) {
+        for (unsigned int i = begin; i < end; i++) {
+            BBox bounds(triangles[i], vertices);
+            glm::vec3 center = build == BVHBuild::SAH || build == BVHBuild::SBVH
+                                   ? boundsCenter(bounds)
+                                   : triangles[i].getCenter(vertices);
+            refs[i] = {bounds, center, i};
+        }
+    });
+    if (build == BVHBuild::SAH)
+        buildNode(refs, 0, refs.size(), 0);
+    else if (build == BVHBuild::SBVH) {
+        BBox rootBounds = refs.at(0).bounds;
+        for (const BVHBuildRef &ref : refs)
+            rootBounds += ref.bounds;
+        unsigned int budget = spatialSplitsBudget * refs.size();
+        buildSBVHNode(refs, 0, rootBounds.surfaceArea(), budget);
+    } else
+        buildLBVH(refs, build, buildThreads);
+    nodes.shrink_to_fit();
+    leavesBlocks.shrink_to_fit();
+    rayRangeBias = KDTree::getRayRangeBias(nodes.at(0).bounds);
+}
+
+unsigned int BVH::blocksCnt(unsigned int trianglesCnt) {
+    return (trianglesCnt + TriangleBlock::width - 1) / TriangleBlock::width;
+}
+
+unsigned int BVH::buildNode(std::vector<BVHBuildRef> &refs, unsigned int begin, unsigned int end,
+                            unsigned int depth) {
+    unsigned int nodeIdx = nodes.size();
+    nodes.push_back({refs.at(begin).bounds, 0, 0, 0});
+    BBox centers(glm::vec2(refs.at(begin).center.x), glm::vec2(refs.at(begin).center.y),
+                 glm::vec2(refs.at(begin).center.z));
+    for (unsigned int i = begin + 1; i < end; i++) {
+        nodes.at(nodeIdx).bounds += refs.at(i).bounds;
+        centers += BBox(glm::vec2(refs.at(i).center.x), glm::vec2(refs.at(i).center.y),
+                        glm::vec2(refs.at(i).center.z));
+    }
+    unsigned int trianglesCnt = end - begin;
+    if (trianglesCnt == 1) {
+        createLeaf(refs, begin, end, nodes.at(nodeIdx), leavesBlocks);
+        return nodeIdx;
+    }
+
+    BVHSplit split;
+    if (depth < maxSAHDepth)
+        split = findObjectSplit(refs, begin, end, centers, nodes.at(nodeIdx).bounds.surfaceArea());
+    unsigned int mid, bestAxis = split.axis;
+    if (split.cost < blocksCnt(trianglesCnt)) {
+        mid = std::partition(refs.begin() + begin, refs.begin() + end,
+                             [&](const BVHBuildRef &ref) {
+                                 return objectBin(ref, centers, split.axis) <= split.bin;
+                             }) -
+              refs.begin();
+    } else if (trianglesCnt > maxLeafCapacity) {
+        // Too many triangles for a leaf, but no split pays off or the node is too deep for SAH.
+        mid = splitAtMedian(refs, begin, end, centers, bestAxis);
+    } else {
+        createLeaf(refs, begin, end, nodes.at(nodeIdx), leavesBlocks);
+        return nodeIdx;
+    }
+
+    nodes.at(nodeIdx).axis = bestAxis;
+    buildNode(refs, begin, mid, depth + 1);
+    unsigned int secondChild = buildNode(refs, mid, end, depth + 1);
+    nodes.at(nodeIdx).offset = secondChild;
+    return nodeIdx;
+}
+
+BVHSplit BVH::findObjectSplit(const std::vector<BVHBuildRef> &refs, unsigned int begin,
+                              unsigned int end, const BBox &centers, float totalSA) {
+    // Binned SAH along every axis, binning triangles by their centers. Intersection cost is
+    // counted in blocks.
+    BVHSplit best;
+    for (unsigned int axis = 0; axis < 3; axis++) {
+        if (centers.dimLength(axis) == 0.f)
+            continue;
+        std::array<BBox, binsCnt> binsBounds;
+        std::array<unsigned int, binsCnt> binsCnts = {};
+        for (unsigned int i = begin; i < end; i++) {
+            unsigned int bin = objectBin(refs[i], centers, axis);
+            if (binsCnts[bin]++ == 0)
+                binsBounds[bin] = refs[i].bounds;
+            else
+                binsBounds[bin] += refs[i].bounds;
+        }
+        // Split after bin i leaves bins (i, binsCnt) above.
+        std::array<BBox, binsCnt> aboveBounds;
+        std::array<unsigned int, binsCnt> aboveCnt;
+        BBox bounds;
+        unsigned int cnt = 0;
+        for (unsigned int i = binsCnt - 1; i > 0; i--) {
+            if (binsCnts[i] > 0)
+                bounds = cnt == 0 ? binsBounds[i] : bounds + binsBounds[i];
+            cnt += binsCnts[i];
+            aboveBounds[i - 1] = bounds;
+            aboveCnt[i - 1] = cnt;
+        }
+        cnt = 0;
+        for (unsigned int i = 0; i < binsCnt - 1; i++) {
+            if (binsCnts[i] > 0)
+                bounds = cnt == 0 ? binsBounds[i] : bounds + binsBounds[i];
+            cnt += binsCnts[i];
+            if (cnt == 0 || aboveCnt[i] == 0)
+                continue;
+            float cost = traversalCost + (bounds.surfaceArea() * blocksCnt(cnt) +
+                                          aboveBounds[i].surfaceArea() * blocksCnt(aboveCnt[i])) /
+                                             totalSA;
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.axis = axis;
+                best.bin = i;
+                best.belowBounds = bounds;
+                best.aboveBounds = aboveBounds[i];
+            }
+        }
+    }
+    return best;
+}
+
+unsigned int BVH::buildSBVHNode(std::vector<BVHBuildRef> &refs, unsigned int depth, float rootSA,
+                                unsigned int &budget) {
+    unsigned int nodeIdx = nodes.size();
+    nodes.push_back({refs.at(0).bounds, 0, 0, 0});
+    BBox centers = pointBounds(refs.at(0).center);
+    for (unsigned int i = 1; i < refs.size(); i++) {
+        nodes.at(nodeIdx).bounds += refs.at(i).bounds;
+        centers += pointBounds(refs.at(i).center);
+    }
+    unsigned int refsCnt = refs.size();
+    if (refsCnt == 1) {
+        createLeaf(refs, 0, refsCnt, nodes.at(nodeIdx), leavesBlocks);
+        refs = {};
+        return nodeIdx;
+    }
+
+    BBox bounds = nodes.at(nodeIdx).bounds;
+    float totalSA = bounds.surfaceArea();
+    BVHSplit objectSplit, spatialSplit;
+    if (depth < maxSAHDepth) {
+        objectSplit = findObjectSplit(refs, 0, refsCnt, centers, totalSA);
+        // Space is worth splitting only where children of the best object split overlap. All
+        // centers being the same leaves no object split at all.
+        float overlapSA = totalSA;
+        if (objectSplit.cost < std::numeric_limits<float>::infinity()) {
+            BBox overlap;
+            overlapSA = 0.f;
+            bool overlapping = true;
+            for (unsigned int axis = 0; axis < 3; axis++) {
+                overlap.axesBounds[axis] =
+                    glm::vec2(std::max(objectSplit.belowBounds.axesBounds[axis][0],
+                                       objectSplit.aboveBounds.axesBounds[axis][0]),
+                              std::min(objectSplit.belowBounds.axesBounds[axis][1],
+                                       objectSplit.aboveBounds.axesBounds[axis][1]));
+                overlapping &= overlap.axesBounds[axis][0] <= overlap.axesBounds[axis][1];
+            }
+            if (overlapping)
+                overlapSA = overlap.surfaceArea();
+        }
+        if (budget > 0 && overlapSA > minSpatialSplitOverlap * rootSA)
+            spatialSplit = findSpatialSplit(refs, bounds, totalSA, budget);
+    }
+
+    std::vector<BVHBuildRef> below, above;
+    unsigned int axis;
+    if (spatialSplit.cost < std::min<float>(objectSplit.cost, blocksCnt(refsCnt))) {
+        axis = spatialSplit.axis;
+        splitSpatially(refs, spatialSplit, below, above);
+        if (below.empty() || above.empty()) {
+            // Rounding errors put all refs on one side of the plane.
+            below.clear();
+            above.clear();
+        } else
+            budget -= std::min<unsigned int>(budget, below.size() + above.size() - refsCnt);
+    }
+    if (below.empty()) {
+        if (objectSplit.cost < blocksCnt(refsCnt)) {
+            axis = objectSplit.axis;
+            for (const BVHBuildRef &ref : refs)
+                (objectBin(ref, centers, axis) <= objectSplit.bin ? below : above).push_back(ref);
+        } else if (refsCnt > maxLeafCapacity) {
+            unsigned int mid = splitAtMedian(refs, 0, refsCnt, centers, axis);
+            below.assign(refs.begin(), refs.begin() + mid);
+            above.assign(refs.begin() + mid, refs.end());
+        } else {
+            createLeaf(refs, 0, refsCnt, nodes.at(nodeIdx), leavesBlocks);
+            refs = {};
+            return nodeIdx;
+        }
+    }
+    refs = {};
+
+    nodes.at(nodeIdx).axis = axis;
+    buildSBVHNode(below, depth + 1, rootSA, budget);
+    unsigned int secondChild = buildSBVHNode(above, depth + 1, rootSA, budget);
+    nodes.at(nodeIdx).offset = secondChild;
+    return nodeIdx;
+}
+
+BVHSplit BVH::findSpatialSplit(const std::vector<BVHBuildRef> &refs, const BBox &bounds,
+                               float totalSA, unsigned int budget) const {
+    BVHSplit best;
+    for (unsigned int axis = 0; axis < 3; axis++) {
+        float binWidth = bounds.dimLength(axis) / binsCnt;
+        if (binWidth == 0.f)
+            continue;
+        float lower = bounds.axesBounds[axis][0];
+        auto binLower = [&](unsigned int bin) { return lower + bin * binWidth; };
+        auto binOf = [&](float pos) {
+            return std::min(binsCnt - 1, (unsigned int)std::max(0.f, (pos - lower) / binWidth));
+        };
+        // Every bin's bounds hold pieces of triangles clipped to it. Triangles are counted in bins
+        // they start (entries) and end (exits) in.
+        std::array<BBox, binsCnt> binsBounds;
+        std::array<bool, binsCnt> binsEmpty;
+        binsEmpty.fill(true);
+        std::array<unsigned int, binsCnt> entries = {}, exits = {};
+        std::vector<glm::vec3> polygon, binPolygon, restPolygon;
+        for (const BVHBuildRef &ref : refs) {
+            unsigned int firstBin = binOf(ref.bounds.axesBounds[axis][0]),
+                         lastBin = binOf(ref.bounds.axesBounds[axis][1]);
+            entries[firstBin]++;
+            exits[lastBin]++;
+            if (firstBin == lastBin) {
+                binsBounds[firstBin] =
+                    binsEmpty[firstBin] ? ref.bounds : binsBounds[firstBin] + ref.bounds;
+                binsEmpty[firstBin] = false;
+                continue;
+            }
+            // Chop the triangle's part inside ref's bounds at bins' planes one by one.
+            const Triangle &tri = triangles.at(ref.trianIdx);
+            polygon.clear();
+            for (unsigned int i = 0; i < 3; i++)
+                polygon.push_back(vertices.at(tri.indices[i]).pos);
+            // Only refs made by spatial splits are smaller than their triangles.
+            for (unsigned int clipAxis = 0; clipAxis < 3; clipAxis++) {
+                auto [lowest, highest] = std::minmax(
+                    {polygon[0][clipAxis], polygon[1][clipAxis], polygon[2][clipAxis]});
+                if (lowest < ref.bounds.axesBounds[clipAxis][0]) {
+                    splitPolygon(polygon, clipAxis, ref.bounds.axesBounds[clipAxis][0],
+                                 binPolygon, restPolygon);
+                    polygon.swap(restPolygon);
+                }
+                if (highest > ref.bounds.axesBounds[clipAxis][1]) {
+                    splitPolygon(polygon, clipAxis, ref.bounds.axesBounds[clipAxis][1],
+                                 restPolygon, binPolygon);
+                    polygon.swap(restPolygon);
+                }
+            }
+            for (unsigned int bin = firstBin; bin <= lastBin; bin++) {
+                if (bin < lastBin) {
+                    splitPolygon(polygon, axis, binLower(bin + 1), binPolygon, restPolygon);
+                    polygon.swap(restPolygon);
+                } else
+                    binPolygon.swap(polygon);
+                BBox binBox = ref.bounds;
+                binBox.axesBounds[axis] =
+                    glm::clamp(ref.bounds.axesBounds[axis], binLower(bin), binLower(bin + 1));
+                // Rounding errors may lose the piece or put it slightly outside the bin.
+                BBox piece = binBox;
+                if (!binPolygon.empty()) {
+                    glm::vec3 lower = binPolygon[0], upper = binPolygon[0];
+                    for (const glm::vec3 &p : binPolygon) {
+                        lower = glm::min(lower, p);
+                        upper = glm::max(upper, p);
+                    }
+                    for (unsigned int clampAxis = 0; clampAxis < 3; clampAxis++)
+                        piece.axesBounds[clampAxis] =
+                            glm::clamp(glm::vec2(lower[clampAxis], upper[clampAxis]),
+                                       binBox.axesBounds[clampAxis][0],
+                                       binBox.axesBounds[clampAxis][1]);
+                }
+                binsBounds[bin] = binsEmpty[bin] ? piece : binsBounds[bin] + piece;
+                binsEmpty[bin] = false;
+            }
+        }
+        // Split after bin i leaves bins (i, binsCnt) above.
+        std::array<BBox, binsCnt> aboveBounds;
+        std::array<unsigned int, binsCnt> aboveCnt;
+        BBox binsUnion;
+        bool unionEmpty = true;
+        unsigned int cnt = 0;
+        for (unsigned int i = binsCnt - 1; i > 0; i--) {
+            if (!binsEmpty[i]) {
+                binsUnion = unionEmpty ? binsBounds[i] : binsUnion + binsBounds[i];
+                unionEmpty = false;
+            }
+            cnt += exits[i];
+            aboveBounds[i - 1] = binsUnion;
+            aboveCnt[i - 1] = cnt;
+        }
+        unionEmpty = true;
+        cnt = 0;
+        for (unsigned int i = 0; i < binsCnt - 1; i++) {
+            if (!binsEmpty[i]) {
+                binsUnion = unionEmpty ? binsBounds[i] : binsUnion + binsBounds[i];
+                unionEmpty = false;
+            }
+            cnt += entries[i];
+            if (cnt == 0 || aboveCnt[i] == 0 || cnt + aboveCnt[i] - refs.size() > budget)
+                continue;
+            float cost = traversalCost + (binsUnion.surfaceArea() * blocksCnt(cnt) +
+                                          aboveBounds[i].surfaceArea() * blocksCnt(aboveCnt[i])) /
+                                             totalSA;
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.axis = axis;
+                best.plane = binLower(i + 1);
+                best.belowBounds = binsUnion;
+                best.aboveBounds = aboveBounds[i];
+            }
+        }
+    }
+    return best;
+}
+
+void BVH::splitSpatially(const std::vector<BVHBuildRef> &refs, const BVHSplit &split,
+                         std::vector<BVHBuildRef> &below, std::vector<BVHBuildRef> &above) const {
+    for (const BVHBuildRef &ref : refs) {
+        if (ref.bounds.axesBounds[split.axis][1] <= split.plane) {
+            below.push_back(ref);
+            continue;
+        }
+        if (ref.bounds.axesBounds[split.axis][0] >= split.plane) {
+            above.push_back(ref);
+            continue;
+        }
+        BBox belowBox = ref.bounds, aboveBox = ref.bounds;
+        belowBox.replaceUpper(split.axis, split.plane);
+        aboveBox.replaceLower(split.axis, split.plane);
+        BBox clippedBelow, clippedAbove;
+        bool isBelow = belowBox.clipTriangle(triangles.at(ref.trianIdx), vertices, clippedBelow),
+             isAbove = aboveBox.clipTriangle(triangles.at(ref.trianIdx), vertices, clippedAbove);
+        if (!isBelow && !isAbove) {
+            // Clipping lost the triangle to rounding errors. Keep it with unclipped bounds.
+            clippedBelow = belowBox;
+            clippedAbove = aboveBox;
+            isBelow = isAbove = true;
+        }
+        if (isBelow)
+            below.push_back({clippedBelow, boundsCenter(clippedBelow), ref.trianIdx});
+        if (isAbove)
+            above.push_back({clippedAbove, boundsCenter(clippedAbove), ref.trianIdx});
+    }
+}
+
+void BVH::createLeaf(const std::vector<BVHBuildRef> &refs, unsigned int begin, unsigned int end,
+                     BVHNode &node, std::vector<TriangleBlock> &blocks) const {
+    node.offset = blocks.size();
+    node.trianglesCnt = end - begin;
+    for (unsigned int i = begin; i < end; i += TriangleBlock::width) {
+        TriangleBlock block;
+        for (unsigned int lane = 0; lane < TriangleBlock::width && i + lane < end; lane++) {
+            unsigned int trianIdx = refs.at(i + lane).trianIdx;
+            block.setLane(lane, triangles.at(trianIdx), trianIdx, vertices);
+        }
+        blocks.push_back(block);
+    }
+}
+
+unsigned int BVH::splitAtMedian(std::vector<BVHBuildRef> &refs, unsigned int begin,
+                                unsigned int end, const BBox &centers, unsigned int &axis) {
+    axis = std::max({0, 1, 2}, [&](unsigned int d1, unsigned int d2) {
+        return centers.dimLength(d1) < centers.dimLength(d2);
+    });
+    unsigned int mid = (begin + end) / 2;
+    std::nth_element(refs.begin() + begin, refs.begin() + mid, refs.begin() + end,
+                     [&](const BVHBuildRef &r1, const BVHBuildRef &r2) {
+                         return r1.center[axis] < r2.center[axis];
+                     });
+    return mid;
+}
+
+void BVH::buildLBVH(std::vector<BVHBuildRef> &refs, BVHBuild build, unsigned int buildThreads) {
+    unsigned int chunksCnt =
+        std::max(1u, std::min<unsigned int>(buildThreads, refs.size() / minParallelChunk));
+    std::vector<std::uint32_t> codes;
+    sortByMortonCodes(refs, codes, chunksCnt);
+
+    // Treelets are runs of triangles whose codes share the highest bits.
+    std::vector<BVHTreelet> treelets;
+    unsigned int treeletShift = 3 * mortonAxisBits - treeletBits;
+    for (unsigned int i = 0; i < refs.size(); i++)
+        if (i == 0 || codes[i] >> treeletShift != codes[i - 1] >> treeletShift) {
+            if (!treelets.empty())
+                treelets.back().end = i;
+            treelets.push_back({i, (unsigned int)refs.size(), BBox(), 0, {}, {}, 0, 0});
+        }
+    parallelForEach(treelets.size(), buildThreads, [&](unsigned int i) {
+        BVHTreelet &treelet = treelets[i];
+        treelet.bounds = refs[treelet.begin].bounds;
+        for (unsigned int j = treelet.begin + 1; j < treelet.end; j++)
+            treelet.bounds += refs[j].bounds;
+    });
+
+    // Levels above treelets are built first, so that treelets know how deep they are.
+    std::vector<unsigned int> order(treelets.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::vector<BVHNode> topNodes;
+    topNodes.reserve(2 * treelets.size() - 1);
+    buildTopLevel(treelets, order, 0, order.size(), 0, build, codes, topNodes);
+
+    // Larger treelets go first, so that threads finish at about the same time.
+    std::sort(order.begin(), order.end(), [&](unsigned int t1, unsigned int t2) {
+        return treelets[t1].end - treelets[t1].begin > treelets[t2].end - treelets[t2].begin;
+    });
+    parallelForEach(treelets.size(), buildThreads, [&](unsigned int i) {
+        BVHTreelet &treelet = treelets[order[i]];
+        emitLBVH(refs, codes, treelet.begin, treelet.end, treelet.depth, treelet.nodes,
+                 treelet.blocks);
+    });
+
+    // Splice treelets into the hierarchy, each taking the place of its top level leaf.
+    std::size_t treeletsNodesCnt = 0, treeletsBlocksCnt = 0;
+    for (BVHTreelet &treelet : treelets) {
+        treelet.blocksOffset = treeletsBlocksCnt;
+        treeletsNodesCnt += treelet.nodes.size();
+        treeletsBlocksCnt += treelet.blocks.size();
+    }
+    nodes.reserve(topNodes.size() - treelets.size() + treeletsNodesCnt);
+    leavesBlocks.resize(treeletsBlocksCnt);
+    appendTopLevel(topNodes, 0, treelets);
+    parallelForEach(treelets.size(), buildThreads, [&](unsigned int i) {
+        BVHTreelet &treelet = treelets[i];
+        for (unsigned int j = 0; j < treelet.nodes.size(); j++) {
+            BVHNode node = treelet.nodes[j];
+            node.offset += node.trianglesCnt > 0 ? treelet.blocksOffset : treelet.nodesOffset;
+            nodes[treelet.nodesOffset + j] = node;
+        }
+        std::copy(treelet.blocks.begin(), treelet.blocks.end(),
+                  leavesBlocks.begin() + treelet.blocksOffset);
+        treelet.nodes = {};
+        treelet.blocks = {};
+    });
+}
+
+void BVH::sortByMortonCodes(std::vector<BVHBuildRef> &refs, std::vector<std::uint32_t> &codes,
+                            unsigned int chunksCnt) {
+    std::vector<BBox> chunksCenters(chunksCnt);
+    parallelFor(refs.size(), chunksCnt, [&](unsigned int chunk, unsigned int begin,
+                                            unsigned int end) {
+        BBox centers = pointBounds(refs[begin].center);
+        for (unsigned int i = begin + 1; i < end; i++)
+            centers += pointBounds(refs[i].center);
+        chunksCenters[chunk] = centers;
+    });
+    BBox centers = chunksCenters[0];
+    for (unsigned int chunk = 1; chunk < chunksCnt; chunk++)
+        centers += chunksCenters[chunk];
+
+    // Codes paired with refs' indices, quantizing centers to a grid of 2^mortonAxisBits cells
+    // along each axis.
+    std::vector<std::pair<std::uint32_t, unsigned int>> keys(refs.size()), sortedKeys(refs.size());
+    glm::vec3 scale;
+    for (unsigned int axis = 0; axis < 3; axis++)
+        scale[axis] = centers.dimLength(axis) > 0.f
+                          ? (1u << mortonAxisBits) / centers.dimLength(axis)
+                          : 0.f;
+    parallelFor(refs.size(), chunksCnt, [&](unsigned int, unsigned int begin, unsigned int end) {
+        for (unsigned int i = begin; i < end; i++) {
+            std::uint32_t code = 0;
+            for (unsigned int axis = 0; axis < 3; axis++) {
+                std::uint32_t cell = std::min(
+                    (1u << mortonAxisBits) - 1,
+                    (std::uint32_t)((refs[i].center[axis] - centers.axesBounds[axis][0]) *
+                                    scale[axis]));
+                code |= spreadBits(cell) << (2 - axis);
+            }
+            keys[i] = {code, i};
+        }
+    });
+
+    // LSD radix sort. Keys of each chunk with the same digit follow those of earlier chunks, which
+    // keeps the sort stable.
+    constexpr unsigned int bucketsCnt = 1u << radixBits;
+    std::vector<std::array<unsigned int, bucketsCnt>> chunksOffsets(chunksCnt);
+    for (unsigned int shift = 0; shift < 3 * mortonAxisBits; shift += radixBits) {
+        parallelFor(refs.size(), chunksCnt, [&](unsigned int chunk, unsigned int begin,
+                                                unsigned int end) {
+            chunksOffsets[chunk].fill(0);
+            for (unsigned int i = begin; i < end; i++)
+                chunksOffsets[chunk][keys[i].first >> shift & (bucketsCnt - 1)]++;
+        });
+        unsigned int offset = 0;
+        for (unsigned int digit = 0; digit < bucketsCnt; digit++)
+            for (std::array<unsigned int, bucketsCnt> &offsets : chunksOffsets) {
+                unsigned int cnt = offsets[digit];
+                offsets[digit] = offset;
+                offset += cnt;
+            }
+        parallelFor(refs.size(), chunksCnt, [&](unsigned int chunk, unsigned int begin,
+                                                unsigned int end) {
+            for (unsigned int i = begin; i < end; i++)
+                sortedKeys[chunksOffsets[chunk][keys[i].first >> shift & (bucketsCnt - 1)]++] =
+                    keys[i];
+        });
+        keys.swap(sortedKeys);
+    }
+
+    std::vector<BVHBuildRef> sortedRefs(refs.size());
+    codes.resize(refs.size());
+    parallelFor(refs.size(), chunksCnt, [&](unsigned int, unsigned int begin, unsigned int end) {
+        for (unsigned int i = begin; i < end; i++) {
+            sortedRefs[i] = refs[keys[i].second];
+            codes[i] = keys[i].first;
+        }
+    });
+    refs.swap(sortedRefs);
+}
+
+unsigned int BVH::buildTopLevel(std::vector<BVHTreelet> &treelets,
+                                std::vector<unsigned int> &order, unsigned int begin,
+                                unsigned int end, unsigned int depth, BVHBuild build,
+                                const std::vector<std::uint32_t> &codes,
+                                std::vector<BVHNode> &topNodes) {
+    unsigned int nodeIdx = topNodes.size();
+    topNodes.push_back({treelets.at(order.at(begin)).bounds, 0, 0, 0});
+    if (end - begin == 1) {
+        treelets.at(order.at(begin)).depth = depth;
+        topNodes.at(nodeIdx).offset = order.at(begin);
+        // Any non-zero count marks a leaf.
+        topNodes.at(nodeIdx).trianglesCnt = 1;
+        return nodeIdx;
+    }
+    BBox centers = pointBounds(boundsCenter(treelets.at(order.at(begin)).bounds));
+    for (unsigned int i = begin + 1; i < end; i++) {
+        topNodes.at(nodeIdx).bounds += treelets.at(order.at(i)).bounds;
+        centers += pointBounds(boundsCenter(treelets.at(order.at(i)).bounds));
+    }
+    auto trianglesCnt = [&](unsigned int treeletIdx) {
+        return treelets.at(treeletIdx).end - treelets.at(treeletIdx).begin;
+    };
+
+    unsigned int mid, axis;
+    if (build == BVHBuild::LBVH) {
+        // Treelets are in the order of their codes, which differ in the highest bits.
+        unsigned int treeletShift = 3 * mortonAxisBits - treeletBits;
+        auto prefix = [&](unsigned int treeletIdx) {
+            return codes.at(treelets.at(treeletIdx).begin) >> treeletShift;
+        };
+        unsigned int bit = 31 - __builtin_clz(prefix(order.at(begin)) ^ prefix(order.at(end - 1)));
+        mid = std::partition_point(
+                  order.begin() + begin, order.begin() + end,
+                  [&](unsigned int treeletIdx) { return !(prefix(treeletIdx) >> bit & 1); }) -
+              order.begin();
+        axis = 2 - (treeletShift + bit) % 3;
+    } else if (depth < treeletBits) {
+        // Exact SAH along every axis, sorting treelets by their centers. There are few of them.
+        float bestCost = std::numeric_limits<float>::infinity();
+        unsigned int bestAxis = 0, bestMid = begin + 1;
+        std::vector<float> aboveCosts(end - begin);
+        for (axis = 0; axis < 3; axis++) {
+            std::sort(order.begin() + begin, order.begin() + end,
+                      [&](unsigned int t1, unsigned int t2) {
+                          return boundsCenter(treelets.at(t1).bounds)[axis] <
+                                 boundsCenter(treelets.at(t2).bounds)[axis];
+                      });
+            // Split before treelet i leaves treelets [i, end) above.
+            BBox bounds = treelets.at(order.at(end - 1)).bounds;
+            unsigned int cnt = 0;
+            for (unsigned int i = end - 1; i > begin; i--) {
+                bounds += treelets.at(order.at(i)).bounds;
+                cnt += trianglesCnt(order.at(i));
+                aboveCosts.at(i - begin) = bounds.surfaceArea() * cnt;
+            }
+            bounds = treelets.at(order.at(begin)).bounds;
+            cnt = 0;
+            for (unsigned int i = begin + 1; i < end; i++) {
+                bounds += treelets.at(order.at(i - 1)).bounds;
+                cnt += trianglesCnt(order.at(i - 1));
+                float cost = bounds.surfaceArea() * cnt + aboveCosts.at(i - begin);
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestMid = i;
+                }
+            }
+        }
+        axis = bestAxis;
+        mid = bestMid;
+        std::sort(order.begin() + begin, order.begin() + end,
+                  [&](unsigned int t1, unsigned int t2) {
+                      return boundsCenter(treelets.at(t1).bounds)[axis] <
+                             boundsCenter(treelets.at(t2).bounds)[axis];
+                  });
+    } else {
+        // Median split keeps levels above treelets at most 2 * treeletBits deep.
+        axis = std::max({0, 1, 2}, [&](unsigned int d1, unsigned int d2) {
+            return centers.dimLength(d1) < centers.dimLength(d2);
+        });
+        mid = (begin + end) / 2;
+        std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+                         [&](unsigned int t1, unsigned int t2) {
+                             return boundsCenter(treelets.at(t1).bounds)[axis] <
+                                    boundsCenter(treelets.at(t2).bounds)[axis];
+                         });
+    }
+
+    topNodes.at(nodeIdx).axis = axis;
+    buildTopLevel(treelets, order, begin, mid, depth + 1, build, codes, topNodes);
+    unsigned int secondChild =
+        buildTopLevel(treelets, order, mid, end, depth + 1, build, codes, topNodes);
+    topNodes.at(nodeIdx).offset = secondChild;
+    return nodeIdx;
+}
+
+unsigned int BVH::emitLBVH(std::vector<BVHBuildRef> &refs, const std::vector<std::uint32_t> &codes,
+                           unsigned int begin, unsigned int end, unsigned int depth,
+                           std::vector<BVHNode> &treeNodes,
+                           std::vector<TriangleBlock> &blocks) const {
+    unsigned int nodeIdx = treeNodes.size();
+    treeNodes.push_back({refs[begin].bounds, 0, 0, 0});
+    if (end - begin <= lbvhLeafCapacity) {
+        for (unsigned int i = begin + 1; i < end; i++)
+            treeNodes[nodeIdx].bounds += refs[i].bounds;
+        createLeaf(refs, begin, end, treeNodes[nodeIdx], blocks);
+        return nodeIdx;
+    }
+
+    unsigned int mid, axis;
+    std::uint32_t differentBits = codes[begin] ^ codes[end - 1];
+    if (depth < maxSAHDepth && differentBits != 0) {
+        // Codes are sorted, so those with the highest different bit set come last.
+        unsigned int bit = 31 - __builtin_clz(differentBits);
+        mid = std::partition_point(codes.begin() + begin, codes.begin() + end,
+                                   [&](std::uint32_t code) { return !(code >> bit & 1); }) -
+              codes.begin();
+        axis = 2 - bit % 3;
+    } else {
+        // Codes no longer tell triangles apart. Codes of the subtree's refs are not used anymore,
+        // as they are either equal or the subtree is too deep for them, so refs may be reordered.
+        BBox centers = pointBounds(refs[begin].center);
+        for (unsigned int i = begin + 1; i < end; i++)
+            centers += pointBounds(refs[i].center);
+        mid = splitAtMedian(refs, begin, end, centers, axis);
+    }
+
+    treeNodes[nodeIdx].axis = axis;
+    unsigned int firstChild = emitLBVH(refs, codes, begin, mid, depth + 1, treeNodes, blocks);
+    unsigned int secondChild = emitLBVH(refs, codes, mid, end, depth + 1, treeNodes, blocks);
+    treeNodes[nodeIdx].offset = secondChild;
+    treeNodes[nodeIdx].bounds = treeNodes[firstChild].bounds + treeNodes[secondChild].bounds;
+    return nodeIdx;
+}
+
+unsigned int BVH::appendTopLevel(const std::vector<BVHNode> &topNodes, unsigned int topIdx,
+                                 std::vector<BVHTreelet> &treelets) {
+    const BVHNode &topNode = topNodes.at(topIdx);
+    if (topNode.trianglesCnt > 0) {
+        BVHTreelet &treelet = treelets.at(topNode.offset);
+        treelet.nodesOffset = nodes.size();
+        nodes.resize(nodes.size() + treelet.nodes.size());
+        return treelet.nodesOffset;
+    }
+    unsigned int nodeIdx = nodes.size();
+    nodes.push_back(topNode);
+    appendTopLevel(topNodes, topIdx + 1, treelets);
+    unsigned int secondChild = appendTopLevel(topNodes, topNode.offset, treelets);
+    nodes.at(nodeIdx).offset = secondChild;
+    return nodeIdx;
+}
+
+bool BVH::intersectBounds(const BBox &bounds, const glm::vec3 &o, const glm::vec3 &invD,
+                          float tMin, float tMax) {
+    for (unsigned int axis = 0; axis < 3; axis++) {
+        float t0 = (bounds.axesBounds[axis][0] - o[axis]) * invD[axis],
+              t1 = (bounds.axesBounds[axis][1] - o[axis]) * invD[axis];
+        if (invD[axis] < 0.f)
+            std::swap(t0, t1);
+        // Rounding errors must not make rays miss boxes they graze, see
+        // https://pbr-book.org/3ed-2018/Shapes/Basic_Shape_Interface#RayndashBoundsIntersections.
+        t1 *= 1.f + 3.f * std::numeric_limits<float>::epsilon();
+        // NaNs, from rays lying in box's faces, leave the range unchanged.
+        tMin = t0 > tMin ? t0 : tMin;
+        tMax = t1 < tMax ? t1 : tMax;
+        if (tMin > tMax)
+            return false;
+    }
+    return true;
+}
+
+bool BVH::findNearestIntersection(const Ray &r, float &t, glm::vec3 &n,
+                                  unsigned int &trianIdx) const {
+    if (nodes.empty())
+        return false;
+    // Offset the same as in KDTree, so that both find the same hits.
+    glm::vec3 o = r.o + r.d * rayRangeBias;
+    glm::vec3 invD = 1.f / r.d;
+    float tMin = r.tMin - rayRangeBias, tNearest = r.tMax;
+    glm::vec2 baryPos;
+    bool hit = false;
+
+    unsigned int stack[maxDepth];
+    unsigned int stackSize = 0, nodeIdx = 0;
+    while (true) {
+        const BVHNode &node = nodes[nodeIdx];
+        if (intersectBounds(node.bounds, o, invD, tMin, tNearest)) {
+            if (node.trianglesCnt == 0) {
+                // Visit the child nearer to the ray's origin first.
+                if (invD[node.axis] < 0.f) {
+                    stack[stackSize++] = nodeIdx + 1;
+                    nodeIdx = node.offset;
+                } else {
+                    stack[stackSize++] = node.offset;
+                    nodeIdx++;
+                }
+                continue;
+            }
+            for (unsigned int i = 0; i < blocksCnt(node.trianglesCnt); i++) {
+                const TriangleBlock &block = leavesBlocks[node.offset + i];
+                glm::vec2 blockBaryPos;
+                int lane = block.intersectNearest(o, r.d, tMin, tNearest, blockBaryPos);
+                if (lane >= 0) {
+                    hit = true;
+                    trianIdx = block.trianIdx[lane];
+                    baryPos = blockBaryPos;
+                }
+            }
+        }
+        if (stackSize == 0)
+            break;
+        nodeIdx = stack[--stackSize];
+    }
+
+    if (!hit)
+        return false;
+    t = tNearest;
+    const Triangle &tri = triangles[trianIdx];
+    const Vertex &a = vertices[tri.indices[0]];
+    const Vertex &b = vertices[tri.indices[1]];
+    const Vertex &c = vertices[tri.indices[2]];
+    n = glm::normalize(a.norm + baryPos.x * (b.norm - a.norm) + baryPos.y * (c.norm - a.norm));
+    return true;
+}
+
+bool BVH::isObstructed(const Ray &r) const {
+    if (nodes.empty())
+        return false;
+    // Surfaces at both ends of the segment must not obstruct it.
+    float tMin = r.tMin + 2.f * rayRangeBias, tMax = r.tMax - 2.f * rayRangeBias;
+    glm::vec3 invD = 1.f / r.d;
+
+    unsigned int stack[maxDepth];
+    unsigned int stackSize = 0, nodeIdx = 0;
+    while (true) {
+        const BVHNode &node = nodes[nodeIdx];
+        if (intersectBounds(node.bounds, r.o, invD, tMin, tMax)) {
+            if (node.trianglesCnt == 0) {
+                stack[stackSize++] = node.offset;
+                nodeIdx++;
+                continue;
+            }
+            for (unsigned int i = 0; i < blocksCnt(node.trianglesCnt); i++)
+                if (leavesBlocks[node.offset + i].intersectAny(r.o, r.d, tMin, tMax))
+                    return true;
+        }
+        if (stackSize == 0)
+            return false;
+        nodeIdx = stack[--stackSize];
+    }
+}
+
+void BVH::printStats(std::ostream &os) const {
+    unsigned int leavesCnt = 0, maxLeafDepth = 0;
+    std::size_t refsCnt = 0;
+    std::vector<std::pair<unsigned int, unsigned int>> stack;
+    if (!nodes.empty())
+        stack.push_back({0, 0});
+    while (!stack.empty()) {
+        auto [nodeIdx, depth] = stack.back();
+        stack.pop_back();
+        const BVHNode &node = nodes.at(nodeIdx);
+        if (node.trianglesCnt > 0) {
+            leavesCnt++;
+            refsCnt += node.trianglesCnt;
+            maxLeafDepth = std::max(maxLeafDepth, depth);
+            continue;
+        }
+        stack.push_back({nodeIdx + 1, depth + 1});
+        stack.push_back({node.offset, depth + 1});
+    }
+    os << "Nodes: " << nodes.size() << ", leaves: " << leavesCnt << ", triangles per leaf: "
+       << (double)refsCnt / std::max(1u, leavesCnt) << ", max depth: " << maxLeafDepth << '\n'
+       << "Triangle references: " << refsCnt << " of " << triangles.size()
+       << " unique triangles (" << (double)refsCnt / std::max<std::size_t>(1, triangles.size())
+       << " per triangle)\n"
+       << "Memory: nodes " << nodes.capacity() * sizeof(BVHNode) / 1024. << " KiB, leaves' blocks "
+       << leavesBlocks.capacity() * sizeof(TriangleBlock) / 1024. << " KiB\n";
+}
@@ -0,0 +1,232 @@
+#pragma once
+
+#include "Accelerator.hpp"
+#include "BBox.hpp"
+#include "Mesh.hpp"
+#include "TriangleBlock.hpp"
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+/**
+ * Node of BVH. Interior node's first child follows it.
+ */
+struct BVHNode {
+    BBox bounds;
+    /* Index of the second child of interior nodes, of the first of leaf's blocks in leaves. */
+    unsigned int offset;
+    /* 0 for interior nodes. */
+    std::uint16_t trianglesCnt;
+    /* Axis interior node's children were split along, the first child lying below. */
+    std::uint8_t axis;
+};
+
+/**
+ * Triangle being sorted into BVH's leaves.
+ */
+struct BVHBuildRef {
+    BBox bounds;
+    /* Center of bounds for SAH builds, Triangle::getCenter for the others. */
+    glm::vec3 center;
+    unsigned int trianIdx;
+};
+
+/**
+ * Split of BVH node's refs chosen by SAH.
+ */
+struct BVHSplit {
+    /* Infinity if no split was found. */
+    float cost = std::numeric_limits<float>::infinity();
+    unsigned int axis = 0;
+    /* Last bin of the lower child for object splits. */
+    unsigned int bin = 0;
+    /* Position of the splitting plane for spatial splits. */
+    float plane = 0.f;
+    BBox belowBounds, aboveBounds;
+};
+
+/**
+ * Subtree of LBVH over triangles whose Morton codes share the highest BVH::treeletBits bits.
+ * Treelets are built in parallel and then spliced into the hierarchy.
+ */
+struct BVHTreelet {
+    /* Range of treelet's triangles' refs, sorted by Morton codes. */
+    unsigned int begin, end;
+    BBox bounds;
+    /* Depth of treelet's root in the hierarchy. */
+    unsigned int depth;
+    /* Subtree with offsets relative to its own nodes and blocks. */
+    std::vector<BVHNode> nodes;
+    std::vector<TriangleBlock> blocks;
+    /* Index of treelet's root in the hierarchy and of its first block in BVH's leaves. */
+    unsigned int nodesOffset, blocksOffset;
+};
+
+enum class BVHBuild {
+    /* Binned SAH over triangles' centers. */
+    SAH,
+    /* Linear BVH: triangles are sorted by Morton codes of their centers and split where the
+     * highest bit of the codes changes. Builds several times faster on all cores, but the
+     * hierarchy is slower to traverse. */
+    LBVH,
+    /* LBVH with levels above treelets built with SAH over the treelets, which pays off for
+     * scenes with unevenly distributed triangles. */
+    HLBVH,
+    /* Spatial split BVH (Stich et al. 2009): binned SAH choosing between partitioning triangles
+     * and splitting space, which references triangles crossing the splitting plane from both
+     * children with bounds clipped to them. Best for scenes of large overlapping triangles. */
+    SBVH
+};
+
+/**
+ * @brief Binary bounding volume hierarchy built with binned SAH over triangles' centers or from
+ * their Morton codes, see BVHBuild. Unlike KDTree it references every triangle once and builds in
+ * a single pass over them per level.
+ */
+class BVH : public Accelerator {
+public:
+    /* Upper bound for tree depth and thus for traversal stack size. */
+    static constexpr unsigned int maxDepth = 64;
+    /* Nodes deeper than that are split at the median instead of by SAH or Morton codes, so that
+     * maxDepth is never exceeded. */
+    static constexpr unsigned int maxSAHDepth = maxDepth / 2;
+    static constexpr unsigned int maxLeafCapacity = 4 * TriangleBlock::width;
+    /* LBVH's leaves hold a single block, as there is no SAH to decide when to stop splitting. */
+    static constexpr unsigned int lbvhLeafCapacity = TriangleBlock::width;
+    /* Spatial splits stop once they have added that many references per triangle. */
+    static constexpr float spatialSplitsBudget = .5f;
+    /* Spatial splits are tried only in nodes whose best object split's children overlap by more
+     * than that fraction of the root's surface area. */
+    static constexpr float minSpatialSplitOverlap = 1e-5f;
+    /* Bits of Morton codes per axis. */
+    static constexpr unsigned int mortonAxisBits = 10;
+    /* Highest bits of Morton codes shared by triangles of a treelet. Levels above treelets are at
+     * most that deep for LBVH and twice that for HLBVH. */
+    static constexpr unsigned int treeletBits = 12;
+    /* Bits of Morton codes sorted by per radix sort pass. */
+    static constexpr unsigned int radixBits = 10;
+    /* Fewest triangles per thread worth starting it for. */
+    static constexpr unsigned int minParallelChunk = 4096;
+    /* Number of bins per axis. */
+    static constexpr unsigned int binsCnt = 16;
+    /* Cost of visiting a node relative to testing a block of triangles. */
+    static constexpr float traversalCost = .5f;
+
+    /**
+     * @param buildThreads Number of threads the hierarchy may be built with. The hierarchy does
+     * not depend on it. SAH and SBVH builds use them only for computing triangles' bounds.
+     */
+    BVH(const std::vector<Triangle> &triangles, const std::vector<Vertex> &vertices,
+        BVHBuild build = BVHBuild::SAH, unsigned int buildThreads = 1);
+    /**
+     * @return Number of blocks holding trianglesCnt triangles of a leaf.
+     */
+    static unsigned int blocksCnt(unsigned int trianglesCnt);
+    bool findNearestIntersection(const Ray &r, float &t, glm::vec3 &n,
+                                 unsigned int &trianIdx) const override;
+    bool isObstructed(const Ray &r) const override;
+    void printStats(std::ostream &os) const override;
+
+private:
+    /* Built by collapsing BVH. */
+    friend class WideBVH;
+
+    const std::vector<Triangle> &triangles;
+    const std::vector<Vertex> &vertices;
+    /* Empty if there are no triangles. */
+    std::vector<BVHNode> nodes;
+    /* Intersection data of leaves' triangles. Each leaf's triangles are packed into its own
+     * blocks. */
+    std::vector<TriangleBlock> leavesBlocks;
+    /* See KDTree::getRayRangeBias. */
+    float rayRangeBias;
+
+    /**
+     * @brief Build the subtree of refs[begin..end), reordering them.
+     * @return Index of subtree's root.
+     */
+    unsigned int buildNode(std::vector<BVHBuildRef> &refs, unsigned int begin, unsigned int end,
+                           unsigned int depth);
+    /**
+     * @brief Build the subtree of refs with SBVH, clearing them.
+     * @param rootSA Surface area of the root's bounds.
+     * @param budget Number of references spatial splits may still add. Decreased by those added.
+     * @return Index of subtree's root.
+     */
+    unsigned int buildSBVHNode(std::vector<BVHBuildRef> &refs, unsigned int depth, float rootSA,
+                               unsigned int &budget);
+    /**
+     * @brief Find the binned SAH split partitioning refs[begin..end) by their centers.
+     * @param centers Bounds of refs' centers.
+     * @param totalSA Surface area of refs' bounds.
+     */
+    static BVHSplit findObjectSplit(const std::vector<BVHBuildRef> &refs, unsigned int begin,
+                                    unsigned int end, const BBox &centers, float totalSA);
+    /**
+     * @brief Find the binned SAH split of bounds by a plane, adding at most budget references.
+     * Triangles are clipped to bins they span.
+     */
+    BVHSplit findSpatialSplit(const std::vector<BVHBuildRef> &refs, const BBox &bounds,
+                              float totalSA, unsigned int budget) const;
+    /**
+     * @brief Distribute refs to children of the spatial split, clipping those crossing its plane.
+     */
+    void splitSpatially(const std::vector<BVHBuildRef> &refs, const BVHSplit &split,
+                        std::vector<BVHBuildRef> &below, std::vector<BVHBuildRef> &above) const;
+    /**
+     * @brief Make node a leaf of refs[begin..end), appending their blocks to blocks.
+     */
+    void createLeaf(const std::vector<BVHBuildRef> &refs, unsigned int begin, unsigned int end,
+                    BVHNode &node, std::vector<TriangleBlock> &blocks) const;
+    /**
+     * @brief Reorder refs[begin..end) so that the lower half of their centers along the longest
+     * axis of centers' bounds comes first.
+     * @param axis Set to the axis.
+     * @return Index of the first ref of the upper half.
+     */
+    static unsigned int splitAtMedian(std::vector<BVHBuildRef> &refs, unsigned int begin,
+                                      unsigned int end, const BBox &centers, unsigned int &axis);
+    /**
+     * @brief Build LBVH or HLBVH over refs, reordering them.
+     */
+    void buildLBVH(std::vector<BVHBuildRef> &refs, BVHBuild build, unsigned int buildThreads);
+    /**
+     * @brief Sort refs by Morton codes of their centers with parallel radix sort.
+     * @param codes Set to the codes of sorted refs.
+     */
+    static void sortByMortonCodes(std::vector<BVHBuildRef> &refs, std::vector<std::uint32_t> &codes,
+                                  unsigned int chunksCnt);
+    /**
+     * @brief Build the levels above treelets[order[begin..end)], reordering order, into topNodes.
+     * Their leaves stand for treelets, with offset being a treelet's index. Sets treelets' depths.
+     * @return Index of subtree's root.
+     */
+    static unsigned int buildTopLevel(std::vector<BVHTreelet> &treelets,
+                                      std::vector<unsigned int> &order, unsigned int begin,
+                                      unsigned int end, unsigned int depth, BVHBuild build,
+                                      const std::vector<std::uint32_t> &codes,
+                                      std::vector<BVHNode> &topNodes);
+    /**
+     * @brief Build the subtree of refs[begin..end), splitting them where the highest bit of their
+     * sorted Morton codes changes.
+     * @return Index of subtree's root in treeNodes.
+     */
+    unsigned int emitLBVH(std::vector<BVHBuildRef> &refs, const std::vector<std::uint32_t> &codes,
+                          unsigned int begin, unsigned int end, unsigned int depth,
+                          std::vector<BVHNode> &treeNodes,
+                          std::vector<TriangleBlock> &blocks) const;
+    /**
+     * @brief Append the subtree of top level node topIdx to nodes, reserving room for its
+     * treelets, which are copied in afterwards.
+     * @return Index of subtree's root in nodes.
+     */
+    unsigned int appendTopLevel(const std::vector<BVHNode> &topNodes, unsigned int topIdx,
+                                std::vector<BVHTreelet> &treelets);
+    /**
+     * @return true if the ray with inverse direction invD passes through the box with t in
+     * [tMin, tMax].
+     */
+    static bool intersectBounds(const BBox &bounds, const glm::vec3 &o, const glm::vec3 &invD,
+                                float tMin, float tMax);
+};
@@ -0,0 +1,26 @@
+#include "Frustum.hpp"
+
+Frustum::Frustum(const glm::vec3 &o, const std::array<glm::vec3, 4> &corners) : o(o) {
+    glm::vec3 center = corners.at(0) + corners.at(1) + corners.at(2) + corners.at(3);
+    for (unsigned int i = 0; i < 4; i++) {
+        glm::vec3 n = glm::cross(corners.at(i), corners.at((i + 1) % 4));
+        float len = glm::length(n);
+        if (len == 0.f) {
+            normals.at(i) = glm::vec3(0);
+            continue;
+        }
+        // Corners may go either way around the frustum.
+        normals.at(i) = glm::dot(n, center) < 0.f ? -n / len : n / len;
+    }
+}
+
+bool Frustum::excludes(const BBox &b, float tolerance) const {
+    for (const glm::vec3 &n : normals) {
+        // box corner lying farthest inside the plane
+        glm::vec3 p(b.axesBounds[0][n.x > 0.f], b.axesBounds[1][n.y > 0.f],
+                    b.axesBounds[2][n.z > 0.f]);
+        if (glm::dot(n, p - o) < -tolerance)
+            return true;
+    }
+    return false;
+}
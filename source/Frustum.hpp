@@ -0,0 +1,28 @@
+#pragma once
+
+#include "BBox.hpp"
+
+#include <glm/glm.hpp>
+
+#include <array>
+
+/**
+ * @brief Pyramid of rays sharing origin, bounded by four side planes passing through the origin.
+ * Contains every ray whose direction is a positive combination of the corner directions.
+ */
+class Frustum {
+public:
+    glm::vec3 o;
+    /* Unit normals pointing inside. Zero for degenerate sides, e.g. of a tile one pixel wide. */
+    std::array<glm::vec3, 4> normals;
+
+    /**
+     * @param corners Directions of the corner rays, in order around the frustum.
+     */
+    Frustum(const glm::vec3 &o, const std::array<glm::vec3, 4> &corners);
+    /**
+     * @return true if the whole box lies farther than tolerance outside one of the side planes,
+     * so that no ray of the frustum can pass through it.
+     */
+    bool excludes(const BBox &b, float tolerance) const;
+};
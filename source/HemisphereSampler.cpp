@@ -34,6 +34,8 @@ RandomHemisphereSampler::RandomHemisphereSampler()
 {
 }
 
+RandomHemisphereSampler::RandomHemisphereSampler(std::mt19937::result_type seed) : randEng(seed) {}
+
 // cosine sampler
 
 glm::vec3 CosineSampler::sample(const Material *mat) {
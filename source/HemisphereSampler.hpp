@@ -19,6 +19,10 @@ public:
 class RandomHemisphereSampler : public HemisphereSampler {
 public:
     RandomHemisphereSampler();
+    /**
+     * @brief Sampler drawing the same sequence of samples every time for given seed.
+     */
+    explicit RandomHemisphereSampler(std::mt19937::result_type seed);
 
 protected:
     std::mt19937 randEng;
@@ -26,6 +30,8 @@ protected:
 
 class CosineSampler : public RandomHemisphereSampler {
 public:
+    using RandomHemisphereSampler::RandomHemisphereSampler;
+
     glm::vec3 sample(const Material *mat = nullptr) override;
     float pdf(const glm::vec3 &v, const Material *mat = nullptr) const override;
 
@@ -5,25 +5,39 @@
 
 #include "KDTree.hpp"
 
-#include <glm/gtx/intersect.hpp>
 #include <glm/gtx/norm.hpp>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <iterator>
 #include <random>
 #include <stdexcept>
+#include <thread>
+#include <tuple>
 
 ////////////////////////////////////////////////////////////////////////////////
 // KDTreeNode
 ////////////////////////////////////////////////////////////////////////////////
 
-void KDTreeNode::initLeaf(const std::vector<unsigned int> &trianglesIndices,
+void KDTreeNode::initLeaf(unsigned int trianglesCnt,
                           std::vector<unsigned int> &leavesElementsIndices) {
     flags = 0b11u;
-    trianglesCnt |= trianglesIndices.size() << 2;
-    leavesElementsIndicesOffset = leavesElementsIndices.size();
-    leavesElementsIndices.insert(leavesElementsIndices.end(), trianglesIndices.begin(),
-                                 trianglesIndices.end());
+    this->trianglesCnt |= trianglesCnt << 2;
+    leavesElementsIndicesOffset = leavesElementsIndices.size() - trianglesCnt;
+    // Pad to whole triangle blocks, so that the offset addresses leaf's first block as well.
+    leavesElementsIndices.resize((leavesElementsIndices.size() + TriangleBlock::width - 1) /
+                                     TriangleBlock::width * TriangleBlock::width,
+                                 ~0u);
 }
 
 void KDTreeNode::initInterior(unsigned int axis, float split) {
@@ -41,24 +55,157 @@ unsigned int KDTreeNode::getSplitAxis() const { return flags & 0b11u; }
 
 bool KDTreeNode::isLeaf() const { return (flags & 0b11u) == 0b11u; }
 
-unsigned int KDTreeNode::getAboveChild() const { return aboveChild >> 2; }
+unsigned int KDTreeNode::getBelowChild() const { return belowChild >> 2; }
+
+unsigned int KDTreeNode::getAboveChild() const { return getBelowChild() + 1; }
+
+void KDTreeNode::setBelowChild(unsigned int idx) { belowChild = idx << 2 | flags & 0b11u; }
+
+////////////////////////////////////////////////////////////////////////////////
+// KDTreeParams
+////////////////////////////////////////////////////////////////////////////////
+
+unsigned int KDTreeParams::defaultMaxDepth(unsigned int trianglesCnt) {
+    return std::round(8 + 1.3f * std::log2(trianglesCnt));
+}
+
+bool KDTreeParams::operator==(const KDTreeParams &other) const {
+    return maxDepth == other.maxDepth && maxLeafCapacity == other.maxLeafCapacity &&
+           emptyBonus == other.emptyBonus && traversalCost == other.traversalCost &&
+           isectCost == other.isectCost;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// KDTreeBuildRegion
+////////////////////////////////////////////////////////////////////////////////
 
-void KDTreeNode::setAboveChild(unsigned int idx) { aboveChild = idx << 2 | flags & 0b11u; }
+void KDTreeBuildRegion::splice(unsigned int nodeIdx, const KDTreeBuildRegion &subtree) {
+    // Subtree's i-th node for i > 0 lands at nodesBase + i.
+    unsigned int nodesBase = nodes.size() - 1, leavesBase = leavesElementsIndices.size();
+    auto relocate = [&](KDTreeNode node) {
+        if (node.isLeaf())
+            node.leavesElementsIndicesOffset += leavesBase;
+        else
+            node.setBelowChild(node.getBelowChild() + nodesBase);
+        return node;
+    };
+    nodes.at(nodeIdx) = relocate(subtree.nodes.at(0));
+    nodes.reserve(nodes.size() + subtree.nodes.size() - 1);
+    for (unsigned int i = 1; i < subtree.nodes.size(); i++)
+        nodes.push_back(relocate(subtree.nodes[i]));
+    leavesElementsIndices.insert(leavesElementsIndices.end(),
+                                 subtree.leavesElementsIndices.begin(),
+                                 subtree.leavesElementsIndices.end());
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 // KDTree
 ////////////////////////////////////////////////////////////////////////////////
 
+/**
+ * @brief Order of edges along an axis, with starting edges before ending ones at the same point.
+ */
+static bool compareEdges(const BoundEdge &e1, const BoundEdge &e2) {
+    if (e1.t == e2.t)
+        return e1.type < e2.type;
+    return e1.t < e2.t;
+}
+
+/**
+ * @brief Layout of the beginning of a cache file, followed by nodes and leavesElementsIndices.
+ */
+struct KDTreeCacheHeader {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t nodesCnt;
+    std::uint32_t leavesElementsIndicesCnt;
+    float rayRangeBias;
+    /* Hash of the input the tree was built for. */
+    std::uint64_t key;
+    /* Hash of nodes and then of leavesElementsIndices. */
+    std::uint64_t checksum;
+    BBox spaceBounds;
+};
+
+/* Binary files of other machines with different node or triangle block layouts are rejected
+ * along with ones of older versions. */
+static const char cacheMagic[8] = {'K', 'D', 'T', 'R', 'E', 'E', '0' + sizeof(KDTreeNode),
+                                   '0' + TriangleBlock::width};
+
+/**
+ * @brief Hash of size bytes at data, continuing from hash h.
+ */
+static std::uint64_t hashBytes(const void *data, std::size_t size, std::uint64_t h) {
+    // Finalizer of MurmurHash3, mixing whole words.
+    auto mix = [](std::uint64_t k) {
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdull;
+        k ^= k >> 33;
+        k *= 0xc4ceb9fe1a85ec53ull;
+        k ^= k >> 33;
+        return k;
+    };
+    const char *bytes = static_cast<const char *>(data);
+    for (std::size_t i = 0; i < size; i += sizeof(std::uint64_t)) {
+        std::uint64_t word = 0;
+        std::memcpy(&word, bytes + i, std::min(sizeof(word), size - i));
+        h = mix(h ^ word) + 0x9e3779b97f4a7c15ull;
+    }
+    return mix(h ^ size);
+}
+
+/* Triangles tested by the current single ray query of the thread. */
+static thread_local Mailbox mailbox;
+#ifdef KDTREE_STATS
+/* Thread's counters and the ones of the query kind in progress. */
+static thread_local KDTreeStats stats;
+static thread_local KDTreeQueryStats *queryStats = &stats.closest;
+#endif // KDTREE_STATS
+
 KDTree::KDTree(const std::vector<Triangle> &triangles, const std::vector<Vertex> &vertices,
                unsigned int maxDepth, unsigned int maxLeafCapacity, float emptyBonus,
-               float traversalCost, float isectCost)
-    : maxLeafCapacity(maxLeafCapacity), maxDepth(maxDepth),
+               float traversalCost, float isectCost, unsigned int buildThreads,
+               KDTreeBuild build, const std::string &cachePath,
+               const std::vector<glm::vec3> &rayHits, bool verbose)
+    : maxLeafCapacity(maxLeafCapacity), maxDepth(std::min(maxDepth, maxTodo)),
       spaceBounds(BBox(triangles.at(0), vertices)), emptyBonus(emptyBonus),
-      traversalCost(traversalCost), isectCost(isectCost) {
+      traversalCost(traversalCost), isectCost(isectCost),
+      idleBuildThreads(std::max(1u, buildThreads) - 1) {
 
-    std::vector<unsigned int> trianglesIndices(triangles.size());
-    std::iota(trianglesIndices.begin(), trianglesIndices.end(), 0);
+    // The tree depends only on positions of triangles' vertices, not on where they are stored,
+    // so a mesh keeps its key when other ones change. The number of threads does not change the
+    // tree either.
+    std::uint64_t cacheKey = hashGeometry(triangles, vertices);
+    std::array<float, 6> params = {(float)maxDepth,  (float)maxLeafCapacity, emptyBonus,
+                                   traversalCost,    isectCost,              (float)build};
+    cacheKey = hashBytes(params.data(), sizeof(params), cacheKey);
+    cacheKey = hashBytes(rayHits.data(), rayHits.size() * sizeof(glm::vec3), cacheKey);
 
+    loadedFromCache = !cachePath.empty() && loadCache(cachePath, cacheKey);
+    if (loadedFromCache) {
+        if (verbose)
+            std::cerr << "Acceleration structure loaded from \"" << cachePath << "\".\n";
+    } else {
+        buildTree(triangles, vertices, maxDepth, build, rayHits);
+        rayRangeBias = getRayRangeBias(spaceBounds);
+        if (!cachePath.empty())
+            saveCache(cachePath, cacheKey);
+    }
+
+    leavesBlocks.resize(leavesElementsIndices.size() / TriangleBlock::width);
+    for (unsigned int i = 0; i < leavesElementsIndices.size(); i++) {
+        unsigned int trianIdx = leavesElementsIndices.at(i);
+        if (trianIdx != ~0u)
+            leavesBlocks.at(i / TriangleBlock::width)
+                .setLane(i % TriangleBlock::width, triangles.at(trianIdx), trianIdx, vertices);
+    }
+    if (verbose)
+        std::cerr << "ray range bias: " << rayRangeBias << '\n';
+}
+
+void KDTree::buildTree(const std::vector<Triangle> &triangles, const std::vector<Vertex> &vertices,
+                       unsigned int maxDepth, KDTreeBuild build,
+                       const std::vector<glm::vec3> &rayHits) {
     std::vector<BBox> trianglesBounds(triangles.size());
     trianglesBounds.at(0) = spaceBounds;
     for (unsigned int i = 1; i < triangles.size(); i++) {
@@ -66,38 +213,155 @@ KDTree::KDTree(const std::vector<Triangle> &triangles, const std::vector<Vertex>
         spaceBounds += trianglesBounds.at(i);
     }
 
-    std::array<std::vector<BoundEdge>, 3> edges({std::vector<BoundEdge>(2 * triangles.size()),
-                                                 std::vector<BoundEdge>(2 * triangles.size()),
-                                                 std::vector<BoundEdge>(2 * triangles.size())});
-    buildTreeSAH(trianglesIndices, maxDepth, ~0u, false, spaceBounds, trianglesBounds, edges, 0);
-    // buildTreeHalfSplits(trianglesIndices, maxDepth, ~0u, false, spaceBounds,
-    //                     trianglesBounds);
+    // Scratch data of the whole build lives in region's arenas, with node's data allocated by its
+    // parent in the arena for node's depth.
+    KDTreeBuildRegion region;
+    region.nodes.resize(1);
+    Arena &rootArena = region.arenas.at(maxDepth % 2);
+    if (build == KDTreeBuild::BinnedSAH) {
+        ArenaVector<KDTreeBuildRef> refs(rootArena);
+        refs.reserve(triangles.size());
+        for (unsigned int trianIdx = 0; trianIdx < triangles.size(); trianIdx++)
+            refs.push_back({trianglesBounds.at(trianIdx), trianIdx});
+        trianglesBounds = {};
+        buildTreeBinnedSAH(region, refs, {}, maxDepth, 0, spaceBounds, 0);
+    } else {
+        // Wald and Havran 2006, "On building fast kd-Trees for Ray Tracing, and on doing that in
+        // O(N log N)". Edges are sorted once here and subsets of them stay sorted down the tree.
+        std::array<ArenaVector<BoundEdge>, 3> edges;
+        std::array<ArenaVector<glm::vec3>, 3> hits;
+        for (unsigned int axis = 0; axis < 3; axis++) {
+            edges.at(axis) = ArenaVector<BoundEdge>(rootArena);
+            edges.at(axis).reserve(2 * triangles.size());
+            hits.at(axis) = ArenaVector<glm::vec3>(rootArena);
+            hits.at(axis).reserve(rayHits.size());
+        }
+        auto insideSpace = [&](const glm::vec3 &hit) {
+            for (unsigned int axis = 0; axis < 3; axis++)
+                if (hit[axis] < spaceBounds.axesBounds.at(axis)[0] ||
+                    hit[axis] > spaceBounds.axesBounds.at(axis)[1])
+                    return false;
+            return true;
+        };
+        auto sortEdges = [&](unsigned int axis) {
+            std::copy_if(rayHits.begin(), rayHits.end(), std::back_inserter(hits.at(axis)),
+                         insideSpace);
+            std::sort(hits.at(axis).begin(), hits.at(axis).end(),
+                      [&](const glm::vec3 &h1, const glm::vec3 &h2) {
+                          return h1[axis] < h2[axis];
+                      });
+            for (unsigned int trianIdx = 0; trianIdx < triangles.size(); trianIdx++) {
+                edges.at(axis).emplace_back(trianglesBounds.at(trianIdx).axesBounds.at(axis)[0],
+                                            trianIdx, true);
+                edges.at(axis).emplace_back(trianglesBounds.at(trianIdx).axesBounds.at(axis)[1],
+                                            trianIdx, false);
+            }
+            std::sort(edges.at(axis).begin(), edges.at(axis).end(), compareEdges);
+        };
+        std::vector<std::thread> sortThreads;
+        for (unsigned int axis = 1; axis < 3; axis++)
+            if (triangles.size() >= minParallelBuildCnt && reserveBuildThread())
+                sortThreads.emplace_back([&, axis]() {
+                    sortEdges(axis);
+                    idleBuildThreads++;
+                });
+            else
+                sortEdges(axis);
+        sortEdges(0);
+        for (std::thread &t : sortThreads)
+            t.join();
+        trianglesBounds = {};
 
-    rayRangeBias = .00005f * std::sqrt(spaceBounds.dimLength(0) * spaceBounds.dimLength(0) +
-                                       spaceBounds.dimLength(1) * spaceBounds.dimLength(1) +
-                                       spaceBounds.dimLength(2) * spaceBounds.dimLength(2));
-    std::cerr << "ray range bias: " << rayRangeBias << '\n';
+        region.trianglesSides.resize(triangles.size(), 0);
+        buildTreeSAH(region, edges, hits, {}, maxDepth, 0, spaceBounds, triangles, vertices, 0);
+    }
+    // Scratch memory is returned to the system at once.
+    region.arenas = {};
+    region.trianglesSides = {};
+    leavesElementsIndices = std::move(region.leavesElementsIndices);
+    layoutTreelets(region.nodes);
 }
 
-bool KDTree::findNearestIntersection(Ray r, const std::vector<Triangle> &triangles,
-                                     const std::vector<Vertex> &vertices, float &t, glm::vec3 &n,
-                                     unsigned int &trianIdx) const {
-    r.o += r.d * rayRangeBias;
-    return findNearestIntersection(r, triangles, vertices, 0, t, n, trianIdx);
+bool KDTree::loadCache(const std::string &path, std::uint64_t key) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+        return false;
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (std::size_t)st.st_size >= sizeof(KDTreeCacheHeader))
+        data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+
+    // Anything unexpected means the file is stale or corrupt and the tree has to be rebuilt.
+    const KDTreeCacheHeader &header = *static_cast<const KDTreeCacheHeader *>(data);
+    const KDTreeNode *fileNodes = reinterpret_cast<const KDTreeNode *>(&header + 1);
+    const unsigned int *fileIndices =
+        reinterpret_cast<const unsigned int *>(fileNodes + header.nodesCnt);
+    std::size_t nodesSize = header.nodesCnt * sizeof(KDTreeNode),
+                indicesSize = header.leavesElementsIndicesCnt * sizeof(unsigned int);
+    bool valid = std::memcmp(header.magic, cacheMagic, sizeof(header.magic)) == 0 &&
+                 header.version == cacheVersion && header.key == key &&
+                 (std::size_t)st.st_size == sizeof(KDTreeCacheHeader) + nodesSize + indicesSize &&
+                 header.checksum ==
+                     hashBytes(fileIndices, indicesSize, hashBytes(fileNodes, nodesSize, 0));
+    if (valid) {
+        nodes.assign(fileNodes, fileNodes + header.nodesCnt);
+        leavesElementsIndices.assign(fileIndices, fileIndices + header.leavesElementsIndicesCnt);
+        spaceBounds = header.spaceBounds;
+        rayRangeBias = header.rayRangeBias;
+    }
+    munmap(data, st.st_size);
+    return valid;
 }
 
-bool KDTree::isObstructed(Ray r, const float target, const std::vector<Triangle> &triangles,
-                          const std::vector<Vertex> &vertices) const {
-    r.o += r.d * rayRangeBias;
-    return isObstructed(r, target, triangles, vertices, 0);
+void KDTree::saveCache(const std::string &path, std::uint64_t key) const {
+    KDTreeCacheHeader header;
+    std::memcpy(header.magic, cacheMagic, sizeof(header.magic));
+    header.version = cacheVersion;
+    header.nodesCnt = nodes.size();
+    header.leavesElementsIndicesCnt = leavesElementsIndices.size();
+    header.rayRangeBias = rayRangeBias;
+    header.key = key;
+    header.checksum =
+        hashBytes(leavesElementsIndices.data(), leavesElementsIndices.size() * sizeof(unsigned int),
+                  hashBytes(nodes.data(), nodes.size() * sizeof(KDTreeNode), 0));
+    header.spaceBounds = spaceBounds;
+
+    // Written to a temporary file of the writing process and thread first and then renamed, so
+    // that concurrent writers never mix their data and readers never see a partial file.
+    std::string tmpPath = path + "." + std::to_string(getpid()) + "." +
+                          std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) +
+                          ".tmp";
+    std::ofstream file(tmpPath, std::ios::binary);
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char *>(nodes.data()), nodes.size() * sizeof(KDTreeNode));
+    file.write(reinterpret_cast<const char *>(leavesElementsIndices.data()),
+               leavesElementsIndices.size() * sizeof(unsigned int));
+    file.close();
+    if (!file || std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+        std::cerr << "Could not write acceleration structure cache \"" << path << "\".\n";
+        std::remove(tmpPath.c_str());
+    }
 }
 
-void KDTree::buildTreeSAH(const std::vector<unsigned int> &trianglesIndices, unsigned int depth,
-                          unsigned int parentNodeIdx, bool aboveSplit, const BBox &nodeBounds,
-                          const std::vector<BBox> &trianglesBounds,
-                          std::array<std::vector<BoundEdge>, 3> &edges, unsigned int badRefines) {
-    if (trianglesIndices.size() <= maxLeafCapacity || depth == 0) {
-        createLeafNode(trianglesIndices, parentNodeIdx, aboveSplit);
+void KDTree::buildTreeSAH(KDTreeBuildRegion &region, std::array<ArenaVector<BoundEdge>, 3> &edges,
+                          std::array<ArenaVector<glm::vec3>, 3> &hits,
+                          const Arena::Mark &edgesMark, unsigned int depth, unsigned int nodeIdx,
+                          const BBox &nodeBounds, const std::vector<Triangle> &triangles,
+                          const std::vector<Vertex> &vertices, unsigned int badRefines) {
+    Arena &arena = region.arenas.at(depth % 2), &childrenArena = region.arenas.at((depth + 1) % 2);
+    unsigned int trianglesCnt = edges.at(0).size() / 2;
+    auto createLeaf = [&]() {
+        for (const BoundEdge &e : edges.at(0))
+            if (e.type == EdgeType::Start)
+                region.leavesElementsIndices.push_back(e.trianIdx);
+        createLeafNode(region, trianglesCnt, nodeIdx);
+        arena.release(edgesMark);
+    };
+    if (trianglesCnt <= maxLeafCapacity || depth == 0) {
+        createLeaf();
         return;
     }
 
@@ -108,50 +372,24 @@ void KDTree::buildTreeSAH(const std::vector<unsigned int> &trianglesIndices, uns
                   return nodeBounds.dimLength(a1) > nodeBounds.dimLength(a2);
               });
     unsigned int bestAxis = -1, bestOffset = -1;
-    float bestCost = std::numeric_limits<float>::max(),
-          oldCost = isectCost * trianglesIndices.size(), totalSA = nodeBounds.surfaceArea();
+    float bestCost = std::numeric_limits<float>::max(), oldCost = isectCost * trianglesCnt;
 
     for (unsigned int i = 0; i < 3; i++) {
         unsigned int axis = candidateAxes.at(i);
 
-        // Initialize edges for axis.
-        for (unsigned int j = 0; j < trianglesIndices.size(); j++) {
-            unsigned int trianIdx = trianglesIndices.at(j);
-            edges.at(axis).at(2 * j) =
-                BoundEdge(trianglesBounds.at(trianIdx).axesBounds.at(axis)[0], trianIdx, true);
-            edges.at(axis).at(2 * j + 1) =
-                BoundEdge(trianglesBounds.at(trianIdx).axesBounds.at(axis)[1], trianIdx, false);
-        }
-        std::sort(edges.at(axis).begin(), edges.at(axis).begin() + trianglesIndices.size() * 2,
-                  [](const BoundEdge &e1, const BoundEdge &e2) {
-                      if (e1.t == e2.t)
-                          return e1.type < e2.type;
-                      return e1.t < e2.t;
-                  });
-
-        // Find the best split for axis.
-        unsigned int nBelow = 0, nAbove = trianglesIndices.size();
-        for (int j = 0; j < 2 * trianglesIndices.size(); j++) {
+        // Find the best split for axis, sweeping over its edges and ray hits sorted at the root.
+        unsigned int nBelow = 0, nAbove = trianglesCnt, hitsBelowCnt = 0;
+        for (int j = 0; j < 2 * trianglesCnt; j++) {
             if (edges.at(axis).at(j).type == EdgeType::End)
                 nAbove--;
             float edgeT = edges.at(axis).at(j).t;
+            for (; hitsBelowCnt < hits.at(axis).size() && hits.at(axis)[hitsBelowCnt][axis] < edgeT;
+                 hitsBelowCnt++)
+                ;
             if (edgeT > nodeBounds.axesBounds.at(axis)[0] &&
                 edgeT < nodeBounds.axesBounds.at(axis)[1]) {
-                // Compute cost for split at j-th edge.
-                unsigned int otherAxis0 = (axis + 1) % 3, otherAxis1 = (axis + 2) % 3;
-                float belowSA =
-                    2 * (nodeBounds.dimLength(otherAxis0) * nodeBounds.dimLength(otherAxis1) +
-                         (edgeT - nodeBounds.axesBounds.at(axis)[0]) *
-                             (nodeBounds.dimLength(otherAxis0) + nodeBounds.dimLength(otherAxis1)));
-                float aboveSA =
-                    2 * (nodeBounds.dimLength(otherAxis0) * nodeBounds.dimLength(otherAxis1) +
-                         (nodeBounds.axesBounds.at(axis)[1] - edgeT) *
-                             (nodeBounds.dimLength(otherAxis0) + nodeBounds.dimLength(otherAxis1)));
-                float pBelow = belowSA / totalSA;
-                float pAbove = aboveSA / totalSA;
-                float eb = (nAbove == 0 || nBelow == 0) ? emptyBonus : 0;
-                float cost =
-                    traversalCost + isectCost * (1 - eb) * (pBelow * nBelow + pAbove * nAbove);
+                float cost = splitCost(nodeBounds, axis, edgeT, nBelow, nAbove, hitsBelowCnt,
+                                       hits.at(axis).size() - hitsBelowCnt);
                 if (cost < bestCost) {
                     bestCost = cost;
                     bestAxis = axis;
@@ -168,193 +406,1081 @@ void KDTree::buildTreeSAH(const std::vector<unsigned int> &trianglesIndices, uns
         if (bestCost > oldCost)
             badRefines++;
 
-        if ((bestCost > 4 * oldCost && trianglesIndices.size() < 16) || bestAxis == -1 ||
-            badRefines == 3) {
-            createLeafNode(trianglesIndices, parentNodeIdx, aboveSplit);
+        if ((bestCost > 4 * oldCost && trianglesCnt < 16) || bestAxis == -1 || badRefines == 3) {
+            createLeaf();
             return;
         } else
             break;
     }
 
-    // Classify triangles with respect to split.
-    std::vector<unsigned int> trianglesIndicesBelow, trianglesIndicesAbove;
+    // Classify triangles with respect to split. Node's temporary data is allocated in its arena on
+    // top of its edges.
+    constexpr unsigned char below = 0b01, above = 0b10;
+    std::vector<unsigned char> &trianglesSides = region.trianglesSides;
+    unsigned int trianglesBelowCnt = 0, trianglesAboveCnt = 0;
     for (unsigned int i = 0; i < bestOffset; i++)
-        if (edges.at(bestAxis).at(i).type == EdgeType::Start)
-            trianglesIndicesBelow.push_back(edges.at(bestAxis).at(i).trianIdx);
-    for (unsigned int i = bestOffset + 1; i < 2 * trianglesIndices.size(); i++)
-        if (edges.at(bestAxis).at(i).type == EdgeType::End)
-            trianglesIndicesAbove.push_back(edges.at(bestAxis).at(i).trianIdx);
-
-    KDTreeNode node;
+        if (edges.at(bestAxis).at(i).type == EdgeType::Start) {
+            trianglesSides.at(edges.at(bestAxis).at(i).trianIdx) |= below;
+            trianglesBelowCnt++;
+        }
+    ArenaVector<unsigned int> straddlingIndices(arena);
+    straddlingIndices.reserve(trianglesBelowCnt);
+    for (unsigned int i = bestOffset + 1; i < 2 * trianglesCnt; i++)
+        if (edges.at(bestAxis).at(i).type == EdgeType::End) {
+            unsigned char &sides = trianglesSides.at(edges.at(bestAxis).at(i).trianIdx);
+            sides |= above;
+            trianglesAboveCnt++;
+            if (sides == (below | above))
+                straddlingIndices.push_back(edges.at(bestAxis).at(i).trianIdx);
+        }
     float split = edges.at(bestAxis).at(bestOffset).t;
-    node.initInterior(bestAxis, split);
-    nodes.push_back(node);
-    if (parentNodeIdx != ~0u && aboveSplit)
-        nodes.at(parentNodeIdx).setAboveChild(nodes.size() - 1);
-    unsigned int nodeIdx = nodes.size() - 1;
-
     BBox belowBounds = nodeBounds, aboveBounds = nodeBounds;
     belowBounds.replaceUpper(bestAxis, split);
-    buildTreeSAH(trianglesIndicesBelow, depth - 1, nodeIdx, false, belowBounds, trianglesBounds,
-                 edges, badRefines);
     aboveBounds.replaceLower(bestAxis, split);
-    buildTreeSAH(trianglesIndicesAbove, depth - 1, nodeIdx, true, aboveBounds, trianglesBounds,
-                 edges, badRefines);
+
+    // Wald and Havran 2006, section 4.3. Triangles overlapping both children are clipped to their
+    // bounds, which gives new edges for them and drops them from children they only overlap with
+    // their bounding boxes.
+    std::array<ArenaVector<BoundEdge>, 3> straddlingEdgesBelow, straddlingEdgesAbove;
+    for (unsigned int axis = 0; axis < 3; axis++) {
+        straddlingEdgesBelow.at(axis) = ArenaVector<BoundEdge>(arena);
+        straddlingEdgesBelow.at(axis).reserve(2 * straddlingIndices.size());
+        straddlingEdgesAbove.at(axis) = ArenaVector<BoundEdge>(arena);
+        straddlingEdgesAbove.at(axis).reserve(2 * straddlingIndices.size());
+    }
+    auto addClippedEdges = [&](unsigned int trianIdx, const BBox &clipped,
+                               std::array<ArenaVector<BoundEdge>, 3> &straddlingEdges) {
+        for (unsigned int axis = 0; axis < 3; axis++) {
+            straddlingEdges.at(axis).emplace_back(clipped.axesBounds[axis][0], trianIdx, true);
+            straddlingEdges.at(axis).emplace_back(clipped.axesBounds[axis][1], trianIdx, false);
+        }
+    };
+    for (unsigned int trianIdx : straddlingIndices) {
+        BBox clippedBelow, clippedAbove;
+        bool isBelow = belowBounds.clipTriangle(triangles.at(trianIdx), vertices, clippedBelow),
+             isAbove = aboveBounds.clipTriangle(triangles.at(trianIdx), vertices, clippedAbove);
+        if (!isBelow && !isAbove) {
+            // Clipping lost the triangle to rounding errors. Keep it with unclipped bounds.
+            BBox bounds(triangles.at(trianIdx), vertices);
+            for (unsigned int axis = 0; axis < 3; axis++) {
+                clippedBelow.axesBounds[axis] = glm::clamp(
+                    bounds.axesBounds[axis], belowBounds.axesBounds[axis][0],
+                    belowBounds.axesBounds[axis][1]);
+                clippedAbove.axesBounds[axis] = glm::clamp(
+                    bounds.axesBounds[axis], aboveBounds.axesBounds[axis][0],
+                    aboveBounds.axesBounds[axis][1]);
+            }
+            isBelow = isAbove = true;
+        }
+        if (isBelow)
+            addClippedEdges(trianIdx, clippedBelow, straddlingEdgesBelow);
+        else
+            trianglesBelowCnt--;
+        if (isAbove)
+            addClippedEdges(trianIdx, clippedAbove, straddlingEdgesAbove);
+        else
+            trianglesAboveCnt--;
+    }
+
+    // Distribute edges among children keeping them sorted, merging sorted new edges of clipped
+    // triangles on the way. Ray hits are distributed as well. Axes of large nodes are distributed
+    // in parallel. Children's data is allocated in the arena for their depth, the above child's
+    // first, as it is built last.
+    unsigned int hitsBelowCnt =
+        std::partition_point(hits.at(bestAxis).begin(), hits.at(bestAxis).end(),
+                             [&](const glm::vec3 &hit) { return hit[bestAxis] < split; }) -
+        hits.at(bestAxis).begin();
+    unsigned int hitsAboveCnt = hits.at(bestAxis).size() - hitsBelowCnt;
+    Arena::Mark aboveMark = childrenArena.mark();
+    std::array<ArenaVector<BoundEdge>, 3> edgesBelow, edgesAbove;
+    std::array<ArenaVector<glm::vec3>, 3> hitsBelow, hitsAbove;
+    for (unsigned int axis = 0; axis < 3; axis++) {
+        edgesAbove.at(axis) = ArenaVector<BoundEdge>(childrenArena);
+        edgesAbove.at(axis).reserve(2 * trianglesAboveCnt);
+        hitsAbove.at(axis) = ArenaVector<glm::vec3>(childrenArena);
+        hitsAbove.at(axis).reserve(hitsAboveCnt);
+    }
+    Arena::Mark belowMark = childrenArena.mark();
+    for (unsigned int axis = 0; axis < 3; axis++) {
+        edgesBelow.at(axis) = ArenaVector<BoundEdge>(childrenArena);
+        edgesBelow.at(axis).reserve(2 * trianglesBelowCnt);
+        hitsBelow.at(axis) = ArenaVector<glm::vec3>(childrenArena);
+        hitsBelow.at(axis).reserve(hitsBelowCnt);
+    }
+    auto distributeEdges = [&](unsigned int axis) {
+        for (const glm::vec3 &hit : hits.at(axis))
+            (hit[bestAxis] < split ? hitsBelow : hitsAbove).at(axis).push_back(hit);
+
+        ArenaVector<BoundEdge> &newEdgesBelow = straddlingEdgesBelow.at(axis),
+                               &newEdgesAbove = straddlingEdgesAbove.at(axis);
+        std::sort(newEdgesBelow.begin(), newEdgesBelow.end(), compareEdges);
+        std::sort(newEdgesAbove.begin(), newEdgesAbove.end(), compareEdges);
+        auto nextBelow = newEdgesBelow.begin(), nextAbove = newEdgesAbove.begin();
+        for (const BoundEdge &e : edges.at(axis)) {
+            unsigned char sides = trianglesSides.at(e.trianIdx);
+            if (sides == below) {
+                for (; nextBelow != newEdgesBelow.end() && compareEdges(*nextBelow, e); nextBelow++)
+                    edgesBelow.at(axis).push_back(*nextBelow);
+                edgesBelow.at(axis).push_back(e);
+            } else if (sides == above) {
+                for (; nextAbove != newEdgesAbove.end() && compareEdges(*nextAbove, e); nextAbove++)
+                    edgesAbove.at(axis).push_back(*nextAbove);
+                edgesAbove.at(axis).push_back(e);
+            }
+        }
+        edgesBelow.at(axis).insert(edgesBelow.at(axis).end(), nextBelow, newEdgesBelow.end());
+        edgesAbove.at(axis).insert(edgesAbove.at(axis).end(), nextAbove, newEdgesAbove.end());
+    };
+    std::vector<std::thread> axesThreads;
+    for (unsigned int axis = 1; axis < 3; axis++)
+        if (trianglesCnt >= minParallelBuildCnt && reserveBuildThread())
+            axesThreads.emplace_back([&, axis]() {
+                distributeEdges(axis);
+                idleBuildThreads++;
+            });
+        else
+            distributeEdges(axis);
+    distributeEdges(0);
+    for (std::thread &t : axesThreads)
+        t.join();
+    for (const BoundEdge &e : edges.at(0))
+        trianglesSides.at(e.trianIdx) = 0;
+    // Node's edges and temporary data are no longer needed while building the subtrees.
+    arena.release(edgesMark);
+
+    unsigned int belowChildIdx = createChildren(region, nodeIdx, bestAxis, split);
+
+    buildChildren(region, belowChildIdx, trianglesAboveCnt >= minParallelBuildCnt,
+                  [&](KDTreeBuildRegion &childRegion, unsigned int childIdx, bool ownThread) {
+                      if (ownThread)
+                          // Only the child's temporary data is allocated in the new region.
+                          buildTreeSAH(childRegion, edgesAbove, hitsAbove,
+                                       childRegion.arenas.at((depth - 1) % 2).mark(), depth - 1,
+                                       childIdx, aboveBounds, triangles, vertices, badRefines);
+                      else if (childIdx == belowChildIdx)
+                          buildTreeSAH(childRegion, edgesBelow, hitsBelow, belowMark, depth - 1,
+                                       childIdx, belowBounds, triangles, vertices, badRefines);
+                      else
+                          buildTreeSAH(childRegion, edgesAbove, hitsAbove, aboveMark, depth - 1,
+                                       childIdx, aboveBounds, triangles, vertices, badRefines);
+                  });
+    // Children release their edges themselves, except for one built by another thread.
+    childrenArena.release(aboveMark);
+}
+
+void KDTree::buildTreeBinnedSAH(KDTreeBuildRegion &region, ArenaVector<KDTreeBuildRef> &refs,
+                                const Arena::Mark &refsMark, unsigned int depth,
+                                unsigned int nodeIdx, const BBox &nodeBounds,
+                                unsigned int badRefines) {
+    Arena &arena = region.arenas.at(depth % 2), &childrenArena = region.arenas.at((depth + 1) % 2);
+    unsigned int trianglesCnt = refs.size();
+    auto createLeaf = [&]() {
+        for (const KDTreeBuildRef &ref : refs)
+            region.leavesElementsIndices.push_back(ref.trianIdx);
+        createLeafNode(region, trianglesCnt, nodeIdx);
+        arena.release(refsMark);
+    };
+    if (trianglesCnt <= maxLeafCapacity || depth == 0) {
+        createLeaf();
+        return;
+    }
+
+    // Count triangles starting and ending in each bin along every axis. Bounds sticking out of the
+    // node fall into its first or last bin.
+    std::array<std::array<unsigned int, binsCnt>, 3> startsCnts = {}, endsCnts = {};
+    std::array<float, 3> binsPerUnit;
+    for (unsigned int axis = 0; axis < 3; axis++)
+        binsPerUnit[axis] =
+            nodeBounds.dimLength(axis) > 0.f ? binsCnt / nodeBounds.dimLength(axis) : 0.f;
+    auto binIdx = [&](unsigned int axis, float t) {
+        return (unsigned int)std::clamp((t - nodeBounds.axesBounds[axis][0]) * binsPerUnit[axis],
+                                        0.f, binsCnt - 1.f);
+    };
+    for (const KDTreeBuildRef &ref : refs)
+        for (unsigned int axis = 0; axis < 3; axis++) {
+            startsCnts[axis][binIdx(axis, ref.bounds.axesBounds[axis][0])]++;
+            endsCnts[axis][binIdx(axis, ref.bounds.axesBounds[axis][1])]++;
+        }
+
+    // Find the best split among bins' boundaries of all axes.
+    unsigned int bestAxis = -1, bestBelowCnt, bestAboveCnt;
+    float bestSplit, bestCost = std::numeric_limits<float>::max(),
+                     oldCost = isectCost * trianglesCnt;
+    for (unsigned int axis = 0; axis < 3; axis++) {
+        unsigned int nBelow = 0, nAbove = trianglesCnt;
+        for (unsigned int i = 1; i < binsCnt; i++) {
+            nBelow += startsCnts[axis][i - 1];
+            nAbove -= endsCnts[axis][i - 1];
+            float split = nodeBounds.axesBounds[axis][0] + nodeBounds.dimLength(axis) * i / binsCnt;
+            if (split <= nodeBounds.axesBounds[axis][0] || split >= nodeBounds.axesBounds[axis][1])
+                continue;
+            float cost = splitCost(nodeBounds, axis, split, nBelow, nAbove);
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = split;
+                bestBelowCnt = nBelow;
+                bestAboveCnt = nAbove;
+            }
+        }
+    }
+
+    if (bestCost > oldCost)
+        badRefines++;
+    if ((bestCost > 4 * oldCost && trianglesCnt < 16) || bestAxis == -1 || badRefines == 3) {
+        createLeaf();
+        return;
+    }
+
+    // Classify triangles with respect to split. Triangles lying in the splitting plane go to both
+    // children. Counts found while binning only approximate the final ones, so children's refs are
+    // counted first and allocated in the arena for their depth, the above child's ones first.
+    auto classify = [&](const KDTreeBuildRef &ref, bool &isBelow, bool &isAbove) {
+        const glm::vec2 &bounds = ref.bounds.axesBounds[bestAxis];
+        isBelow = bounds[0] < bestSplit;
+        isAbove = bounds[1] > bestSplit;
+        if (!isBelow && !isAbove)
+            isBelow = isAbove = true;
+    };
+    unsigned int refsBelowCnt = 0, refsAboveCnt = 0;
+    for (const KDTreeBuildRef &ref : refs) {
+        bool isBelow, isAbove;
+        classify(ref, isBelow, isAbove);
+        refsBelowCnt += isBelow;
+        refsAboveCnt += isAbove;
+    }
+    Arena::Mark aboveMark = childrenArena.mark();
+    ArenaVector<KDTreeBuildRef> refsAbove(childrenArena);
+    refsAbove.reserve(refsAboveCnt);
+    Arena::Mark belowMark = childrenArena.mark();
+    ArenaVector<KDTreeBuildRef> refsBelow(childrenArena);
+    refsBelow.reserve(refsBelowCnt);
+    for (const KDTreeBuildRef &ref : refs) {
+        bool isBelow, isAbove;
+        classify(ref, isBelow, isAbove);
+        if (isBelow)
+            refsBelow.push_back(ref);
+        if (isAbove)
+            refsAbove.push_back(ref);
+    }
+    // Parent's triangles are no longer needed while building the subtrees.
+    arena.release(refsMark);
+
+    unsigned int belowChildIdx = createChildren(region, nodeIdx, bestAxis, bestSplit);
+
+    BBox belowBounds = nodeBounds, aboveBounds = nodeBounds;
+    belowBounds.replaceUpper(bestAxis, bestSplit);
+    aboveBounds.replaceLower(bestAxis, bestSplit);
+    buildChildren(region, belowChildIdx, refsAbove.size() >= minParallelBuildCnt,
+                  [&](KDTreeBuildRegion &childRegion, unsigned int childIdx, bool ownThread) {
+                      bool isBelow = !ownThread && childIdx == belowChildIdx;
+                      Arena::Mark childMark =
+                          ownThread ? childRegion.arenas.at((depth - 1) % 2).mark()
+                                    : isBelow ? belowMark : aboveMark;
+                      buildTreeBinnedSAH(childRegion, isBelow ? refsBelow : refsAbove, childMark,
+                                         depth - 1, childIdx,
+                                         isBelow ? belowBounds : aboveBounds, badRefines);
+                  });
+    // Children release their refs themselves, except for one built by another thread.
+    childrenArena.release(aboveMark);
 }
 
-void KDTree::buildTreeHalfSplits(std::vector<unsigned int> &trianglesIndices, unsigned int depth,
-                                 unsigned int parentNodeIdx, bool aboveSplit,
-                                 const BBox &nodeBounds, const std::vector<BBox> &trianglesBounds) {
+float KDTree::splitCost(const BBox &nodeBounds, unsigned int axis, float split,
+                        unsigned int trianglesBelowCnt, unsigned int trianglesAboveCnt,
+                        unsigned int hitsBelowCnt, unsigned int hitsAboveCnt) const {
+    unsigned int otherAxis0 = (axis + 1) % 3, otherAxis1 = (axis + 2) % 3;
+    float belowSA =
+        2 * (nodeBounds.dimLength(otherAxis0) * nodeBounds.dimLength(otherAxis1) +
+             (split - nodeBounds.axesBounds.at(axis)[0]) *
+                 (nodeBounds.dimLength(otherAxis0) + nodeBounds.dimLength(otherAxis1)));
+    float aboveSA =
+        2 * (nodeBounds.dimLength(otherAxis0) * nodeBounds.dimLength(otherAxis1) +
+             (nodeBounds.axesBounds.at(axis)[1] - split) *
+                 (nodeBounds.dimLength(otherAxis0) + nodeBounds.dimLength(otherAxis1)));
+    float totalSA = nodeBounds.surfaceArea();
+    float pBelow = belowSA / totalSA;
+    float pAbove = aboveSA / totalSA;
+    if (hitsBelowCnt + hitsAboveCnt > 0) {
+        // Children are visited more often where rays end more often.
+        float hitsCnt = hitsBelowCnt + hitsAboveCnt;
+        pBelow = (1 - rayHitsWeight) * pBelow + rayHitsWeight * hitsBelowCnt / hitsCnt;
+        pAbove = (1 - rayHitsWeight) * pAbove + rayHitsWeight * hitsAboveCnt / hitsCnt;
+    }
+    float eb = (trianglesAboveCnt == 0 || trianglesBelowCnt == 0) ? emptyBonus : 0;
+    return traversalCost +
+           isectCost * (1 - eb) * (pBelow * trianglesBelowCnt + pAbove * trianglesAboveCnt);
+}
+
+template <typename F>
+void KDTree::buildChildren(KDTreeBuildRegion &region, unsigned int belowChildIdx, bool parallel,
+                           F buildChild) {
+    if (!parallel || !reserveBuildThread()) {
+        buildChild(region, belowChildIdx, false);
+        buildChild(region, belowChildIdx + 1, false);
+        return;
+    }
+    // The above subtree is appended after the below one, as it would be by a single thread.
+    KDTreeBuildRegion aboveRegion;
+    aboveRegion.nodes.resize(1);
+    aboveRegion.trianglesSides.resize(region.trianglesSides.size(), 0);
+    std::thread aboveThread([&]() {
+        buildChild(aboveRegion, 0, true);
+        idleBuildThreads++;
+    });
+    buildChild(region, belowChildIdx, false);
+    // Let other threads use this one's share while it waits.
+    idleBuildThreads++;
+    aboveThread.join();
+    idleBuildThreads--;
+    region.splice(belowChildIdx + 1, aboveRegion);
+}
+
+void KDTree::buildTreeHalfSplits(KDTreeBuildRegion &region,
+                                 ArenaVector<unsigned int> &trianglesIndices,
+                                 const Arena::Mark &trianglesIndicesMark, unsigned int depth,
+                                 unsigned int nodeIdx, const BBox &nodeBounds,
+                                 const std::vector<BBox> &trianglesBounds) {
+    Arena &arena = region.arenas.at(depth % 2), &childrenArena = region.arenas.at((depth + 1) % 2);
 
     if (trianglesIndices.size() <= maxLeafCapacity || depth == 0) {
-        createLeafNode(trianglesIndices, parentNodeIdx, aboveSplit);
+        region.leavesElementsIndices.insert(region.leavesElementsIndices.end(),
+                                            trianglesIndices.begin(), trianglesIndices.end());
+        createLeafNode(region, trianglesIndices.size(), nodeIdx);
+        arena.release(trianglesIndicesMark);
         return;
     }
 
     // create interior node
-    KDTreeNode node;
     unsigned int axis = std::max({0, 1, 2}, [&](unsigned int d1, unsigned int d2) {
         return nodeBounds.dimLength(d1) < nodeBounds.dimLength(d2);
     });
     float split = (nodeBounds.dimBounds(axis)[0] + nodeBounds.dimBounds(axis)[1]) / 2.f;
 
-    std::vector<unsigned int> trianglesIndicesBelow, trianglesIndicesAbove;
+    unsigned int trianglesBelowCnt = 0, trianglesAboveCnt = 0;
+    for (const unsigned int i : trianglesIndices) {
+        trianglesBelowCnt += trianglesBounds[i].axesBounds[axis][0] <= split;
+        trianglesAboveCnt += trianglesBounds[i].axesBounds[axis][1] >= split;
+    }
+    Arena::Mark aboveMark = childrenArena.mark();
+    ArenaVector<unsigned int> trianglesIndicesAbove(childrenArena);
+    trianglesIndicesAbove.reserve(trianglesAboveCnt);
+    Arena::Mark belowMark = childrenArena.mark();
+    ArenaVector<unsigned int> trianglesIndicesBelow(childrenArena);
+    trianglesIndicesBelow.reserve(trianglesBelowCnt);
     for (const unsigned int i : trianglesIndices) {
         if (trianglesBounds[i].axesBounds[axis][0] <= split)
             trianglesIndicesBelow.push_back(i);
         if (trianglesBounds[i].axesBounds[axis][1] >= split)
             trianglesIndicesAbove.push_back(i);
     }
+    arena.release(trianglesIndicesMark);
 
-    node.initInterior(axis, split);
-    nodes.push_back(node);
-    if (parentNodeIdx != ~0u && aboveSplit)
-        nodes.at(parentNodeIdx).setAboveChild(nodes.size() - 1);
-    unsigned int nodeIdx = nodes.size() - 1;
+    unsigned int belowChildIdx = createChildren(region, nodeIdx, axis, split);
 
     BBox belowBounds = nodeBounds, aboveBounds = nodeBounds;
     belowBounds.replaceUpper(axis, split);
-    buildTreeHalfSplits(trianglesIndicesBelow, depth - 1, nodeIdx, false, belowBounds,
-                        trianglesBounds);
+    buildTreeHalfSplits(region, trianglesIndicesBelow, belowMark, depth - 1, belowChildIdx,
+                        belowBounds, trianglesBounds);
     aboveBounds.replaceLower(axis, split);
-    buildTreeHalfSplits(trianglesIndicesAbove, depth - 1, nodeIdx, true, aboveBounds,
-                        trianglesBounds);
+    buildTreeHalfSplits(region, trianglesIndicesAbove, aboveMark, depth - 1, belowChildIdx + 1,
+                        aboveBounds, trianglesBounds);
+}
+
+bool KDTree::findNearestIntersection(Ray r, const std::vector<Triangle> &triangles,
+                                     const std::vector<Vertex> &vertices, float &t, glm::vec3 &n,
+                                     unsigned int &trianIdx) const {
+    return findNearestIntersection(r, triangles, vertices, t, n, trianIdx, {0, spaceBounds});
 }
 
 bool KDTree::findNearestIntersection(Ray r, const std::vector<Triangle> &triangles,
-                                     const std::vector<Vertex> &vertices, unsigned int nodeIdx,
-                                     float &t, glm::vec3 &n, unsigned int &trianIdx) const {
-    if (r.tMax < r.tMin)
+                                     const std::vector<Vertex> &vertices, float &t, glm::vec3 &n,
+                                     unsigned int &trianIdx, const KDTreeEntryPoint &entry) const {
+    KDTREE_STAT(queryStats = &stats.closest; queryStats->queries++);
+    r.o += r.d * rayRangeBias;
+    float tMin, tMax;
+    if (!entry.bounds.intersect(r, tMin, tMax))
         return false;
 
-    const KDTreeNode &node = nodes.at(nodeIdx);
+    // With mailboxing every triangle is tested once per ray, so a hit found beyond the leaf it
+    // was tested in must be kept until a leaf containing it is reached.
+    mailbox.nextRay();
+    const float rayTMin = tMin - rayRangeBias;
+    float tNearest = std::numeric_limits<float>::infinity();
+    glm::vec2 baryPos;
+    bool hit = false;
+    auto visitLeaf = [&](unsigned int leafIdx, float leafTMin, float leafTMax) {
+        hit |= intersectLeaf(nodes[leafIdx], r.o, r.d, rayTMin, tNearest, baryPos, trianIdx,
+                             &mailbox);
+        return hit && tNearest <= leafTMax + rayRangeBias;
+    };
+    if (traversal != KDTreeTraversal::Ropes ||
+        !walkRopes(r, entry.nodeIdx, tMin, tMax, visitLeaf))
+        walkStack(r, entry.nodeIdx, tMin, tMax, visitLeaf);
 
-    if (node.isLeaf()) {
-        float tNearest = r.tMax + rayRangeBias;
-        glm::vec2 baryPos;
+    if (!hit)
+        return false;
+    KDTREE_STAT(queryStats->hits++);
+    t = tNearest;
+    n = interpolateNormal(trianIdx, baryPos, triangles, vertices);
+    return true;
+}
 
-        for (int i = 0; i < node.getTrianglesCnt(); i++) {
-            const Triangle &tri =
-                triangles.at(leavesElementsIndices.at(node.leavesElementsIndicesOffset + i));
-            const Vertex &a = vertices.at(tri.indices[0]);
-            const Vertex &b = vertices.at(tri.indices[1]);
-            const Vertex &c = vertices.at(tri.indices[2]);
-            if (!glm::intersectRayTriangle(r.o, r.d, a.pos, b.pos, c.pos, baryPos, t))
-                continue;
-            if (r.tMin - rayRangeBias < t && t < tNearest) {
-                tNearest = t;
-                n = a.norm + baryPos.x * (b.norm - a.norm) + baryPos.y * (c.norm - a.norm);
-                trianIdx = leavesElementsIndices.at(node.leavesElementsIndicesOffset + i);
+void KDTree::findNearestIntersections(const RayPacket &packet,
+                                      const std::vector<Triangle> &triangles,
+                                      const std::vector<Vertex> &vertices,
+                                      RayPacketHits &hits) const {
+    findNearestIntersections(packet, triangles, vertices, hits, {0, spaceBounds});
+}
+
+void KDTree::findNearestIntersections(const RayPacket &packet,
+                                      const std::vector<Triangle> &triangles,
+                                      const std::vector<Vertex> &vertices, RayPacketHits &hits,
+                                      const KDTreeEntryPoint &entry) const {
+    for (unsigned int i = 0; i < RayPacket::size; i++)
+        hits.hit[i] = false;
+    KDTREE_STAT(queryStats = &stats.closest);
+
+#ifdef SIMD_AVAILABLE
+    constexpr unsigned int size = RayPacket::size;
+    struct PacketTodo {
+        unsigned int nodeIdx;
+        unsigned int active; // mask of rays for which the node is to be visited
+        alignas(32) float tMin[size];
+        alignas(32) float tMax[size];
+    };
+
+    alignas(32) float o[3][size], d[3][size];
+    PacketTodo todo[maxTodo], cur;
+    unsigned int todoPos = 0, done = 0; // mask of rays that found their hit or missed the scene
+    cur.nodeIdx = entry.nodeIdx;
+    cur.active = 0;
+    for (unsigned int i = 0; i < size; i++)
+        cur.tMin[i] = cur.tMax[i] = 0.f;
+    for (unsigned int i = 0; i < packet.cnt; i++) {
+        Ray r = packet.getRay(i);
+        r.o += r.d * rayRangeBias;
+        for (unsigned int axis = 0; axis < 3; axis++) {
+            o[axis][i] = r.o[axis];
+            d[axis][i] = r.d[axis];
+        }
+        if (entry.bounds.intersect(r, cur.tMin[i], cur.tMax[i]))
+            cur.active |= 1u << i;
+    }
+    for (unsigned int i = packet.cnt; i < size; i++)
+        for (unsigned int axis = 0; axis < 3; axis++)
+            o[axis][i] = d[axis][i] = 1.f;
+
+    while (true) {
+        if ((cur.active & ~done) == 0) {
+            // Pop next node that is still needed by some ray.
+            do {
+                if (todoPos == 0) {
+                    KDTREE_STAT(queryStats->queries += packet.cnt;
+                                queryStats->hits += __builtin_popcount(done));
+                    return;
+                }
+                cur = todo[--todoPos];
+            } while ((cur.active & ~done) == 0);
+        }
+        const KDTreeNode &node = nodes[cur.nodeIdx];
+        KDTREE_STAT(queryStats->nodesVisited += __builtin_popcount(cur.active & ~done));
+
+        if (node.isLeaf()) {
+            for (unsigned int i = 0; i < size; i++) {
+                if ((cur.active & ~done & 1u << i) == 0)
+                    continue;
+                KDTREE_STAT(queryStats->leavesVisited++);
+                glm::vec3 ro(o[0][i], o[1][i], o[2][i]), rd(d[0][i], d[1][i], d[2][i]);
+                float tNearest = cur.tMax[i] + rayRangeBias;
+                glm::vec2 baryPos;
+                if (intersectLeaf(node, ro, rd, cur.tMin[i] - rayRangeBias, tNearest, baryPos,
+                                  hits.trianIdx[i])) {
+                    hits.hit[i] = true;
+                    hits.t[i] = tNearest;
+                    hits.n[i] = interpolateNormal(hits.trianIdx[i], baryPos, triangles, vertices);
+                    done |= 1u << i;
+                }
             }
+            cur.active = 0;
+            continue;
+        }
+
+        // interior node
+        unsigned int splitAxis = node.getSplitAxis();
+        const vfloat split = vset1(node.getSplitPos()), zero = vset1(0.f);
+        unsigned int belowMask = 0, firstOnlyMask = 0, secondOnlyMask = 0;
+        alignas(32) float tPlane[size];
+        for (unsigned int k = 0; k < size; k += simdWidth) {
+            vfloat ro = vload(&o[splitAxis][k]), rd = vload(&d[splitAxis][k]);
+            vfloat tMin = vload(&cur.tMin[k]), tMax = vload(&cur.tMax[k]);
+            vfloat below = vor(vlt(ro, split), vand(veq(ro, split), vle(rd, zero)));
+            vfloat t = vdiv(vsub(split, ro), rd);
+            vfloat firstOnly = vor(vgt(t, tMax), vle(t, zero));
+            vfloat secondOnly = vandnot(firstOnly, vlt(t, tMin));
+            vstore(&tPlane[k], t);
+            belowMask |= vmask(below) << k;
+            firstOnlyMask |= vmask(firstOnly) << k;
+            secondOnlyMask |= vmask(secondOnly) << k;
+        }
+
+        unsigned int active = cur.active & ~done;
+        if ((belowMask & active) != 0 && (belowMask & active) != active)
+            break; // rays disagree on which child comes first
+        unsigned int firstChildIdx, secondChildIdx;
+        if ((belowMask & active) != 0) {
+            firstChildIdx = node.getBelowChild();
+            secondChildIdx = node.getAboveChild();
+        } else {
+            firstChildIdx = node.getAboveChild();
+            secondChildIdx = node.getBelowChild();
+        }
+
+        unsigned int firstActive = active & ~secondOnlyMask,
+                     secondActive = active & ~firstOnlyMask;
+        if (secondActive == 0)
+            cur.nodeIdx = firstChildIdx;
+        else if (firstActive == 0)
+            cur.nodeIdx = secondChildIdx;
+        else {
+            // Rays needing both children enter the second one at the plane and leave the first
+            // one there.
+            PacketTodo &second = todo[todoPos++];
+            second.nodeIdx = secondChildIdx;
+            second.active = secondActive;
+            for (unsigned int k = 0; k < size; k += simdWidth) {
+                vfloat t = vload(&tPlane[k]), tMin = vload(&cur.tMin[k]),
+                       tMax = vload(&cur.tMax[k]);
+                vfloat firstOnly = vor(vgt(t, tMax), vle(t, zero));
+                vfloat both = vandnot(vor(firstOnly, vlt(t, tMin)), veq(zero, zero));
+                vstore(&second.tMin[k], vblend(both, t, tMin));
+                vstore(&second.tMax[k], tMax);
+                vstore(&cur.tMax[k], vblend(both, t, tMax));
+            }
+            cur.nodeIdx = firstChildIdx;
+            cur.active = firstActive;
         }
-        if (tNearest == r.tMax + rayRangeBias) // value not changed
-            return false;
-        t = tNearest;
-        n = glm::normalize(n);
-        return true;
-    }
-
-    // interior node
-    unsigned int splitAxis = node.getSplitAxis(), firstChildIdx, secondChildIdx;
-    bool below = r.o[splitAxis] < node.getSplitPos() ||
-                 r.o[splitAxis] == node.getSplitPos() && r.d[splitAxis] <= 0;
-    if (below) {
-        firstChildIdx = nodeIdx + 1;
-        secondChildIdx = node.getAboveChild();
-    } else {
-        firstChildIdx = node.getAboveChild();
-        secondChildIdx = nodeIdx + 1;
-    }
-    float tPlane = (node.getSplitPos() - r.o[splitAxis]) / r.d[splitAxis];
-    if (tPlane > r.tMax || tPlane <= 0)
-        return findNearestIntersection(r, triangles, vertices, firstChildIdx, t, n, trianIdx);
-    else if (tPlane < r.tMin)
-        return findNearestIntersection(r, triangles, vertices, secondChildIdx, t, n, trianIdx);
-    else {
-        if (findNearestIntersection(Ray(r.o, r.d, r.tMin, tPlane), triangles, vertices,
-                                    firstChildIdx, t, n, trianIdx))
-            return true;
-        else
-            return findNearestIntersection(Ray(r.o, r.d, tPlane, r.tMax), triangles, vertices,
-                                           secondChildIdx, t, n, trianIdx);
     }
+
+    // Packet diverged, finish remaining rays separately.
+    KDTREE_STAT(queryStats->queries += __builtin_popcount(done);
+                queryStats->hits += __builtin_popcount(done));
+    for (unsigned int i = 0; i < packet.cnt; i++)
+        if ((done & 1u << i) == 0)
+            hits.hit[i] = findNearestIntersection(packet.getRay(i), triangles, vertices, hits.t[i],
+                                                  hits.n[i], hits.trianIdx[i], entry);
+#else
+    for (unsigned int i = 0; i < packet.cnt; i++)
+        hits.hit[i] = findNearestIntersection(packet.getRay(i), triangles, vertices, hits.t[i],
+                                              hits.n[i], hits.trianIdx[i], entry);
+#endif // SIMD_AVAILABLE
 }
 
-bool KDTree::isObstructed(Ray r, const float target, const std::vector<Triangle> &triangles,
-                          const std::vector<Vertex> &vertices, unsigned int nodeIdx) const {
-    if (r.tMax < r.tMin)
+bool KDTree::isObstructed(Ray r) const {
+    // Surfaces at both ends of the segment must not obstruct it.
+    r.tMin += 2.f * rayRangeBias;
+    r.tMax -= 2.f * rayRangeBias;
+    KDTREE_STAT(queryStats = &stats.shadow; queryStats->queries++);
+    float tMin, tMax;
+    if (!spaceBounds.intersect(r, tMin, tMax))
         return false;
 
-    const KDTreeNode &node = nodes.at(nodeIdx);
+    mailbox.nextRay();
+    bool obstructed = false;
+    auto visitLeaf = [&](unsigned int leafIdx, float leafTMin, float leafTMax) {
+        return obstructed = intersectLeafAny(nodes[leafIdx], r.o, r.d, r.tMin, r.tMax, &mailbox);
+    };
+    if (traversal != KDTreeTraversal::Ropes || !walkRopes(r, 0, tMin, tMax, visitLeaf))
+        walkStack(r, 0, tMin, tMax, visitLeaf);
+    KDTREE_STAT(queryStats->hits += obstructed);
+    return obstructed;
+}
 
-    if (node.isLeaf()) {
-        float t;
-        glm::vec2 baryPos;
+KDTreeEntryPoint KDTree::findEntryPoint(const Frustum &frustum) const {
+    KDTreeEntryPoint entry = {0, spaceBounds};
+    while (!nodes[entry.nodeIdx].isLeaf()) {
+        const KDTreeNode &node = nodes[entry.nodeIdx];
+        BBox belowBounds = entry.bounds, aboveBounds = entry.bounds;
+        belowBounds.replaceUpper(node.getSplitAxis(), node.getSplitPos());
+        aboveBounds.replaceLower(node.getSplitAxis(), node.getSplitPos());
+        // Rays are tested against triangles up to rayRangeBias outside of leaves.
+        bool belowExcluded = frustum.excludes(belowBounds, rayRangeBias),
+             aboveExcluded = frustum.excludes(aboveBounds, rayRangeBias);
+        if (belowExcluded == aboveExcluded)
+            break;
+        if (aboveExcluded)
+            entry = {node.getBelowChild(), belowBounds};
+        else
+            entry = {node.getAboveChild(), aboveBounds};
+    }
+    return entry;
+}
 
-        for (int i = 0; i < node.getTrianglesCnt(); i++) {
-            const Triangle &tri =
-                triangles.at(leavesElementsIndices.at(node.leavesElementsIndicesOffset + i));
-            const Vertex &a = vertices.at(tri.indices[0]);
-            const Vertex &b = vertices.at(tri.indices[1]);
-            const Vertex &c = vertices.at(tri.indices[2]);
-            if (!glm::intersectRayTriangle(r.o, r.d, a.pos, b.pos, c.pos, baryPos, t))
-                continue;
-            if (r.tMin + rayRangeBias < t && t < target)
-                return true;
+void KDTree::isObstructed(const Ray *rays, unsigned int cnt, bool *obstructed) const {
+    for (unsigned int i = 0; i < cnt; i++)
+        obstructed[i] = isObstructed(rays[i]);
+}
+
+void KDTree::takeMailboxStats(unsigned long long &testedCnt, unsigned long long &skippedCnt) {
+    testedCnt = mailbox.testedCnt;
+    skippedCnt = mailbox.skippedCnt;
+    mailbox.testedCnt = mailbox.skippedCnt = 0;
+}
+
+KDTreeStats KDTree::takeStats() {
+#ifdef KDTREE_STATS
+    KDTreeStats ret = stats;
+    stats = KDTreeStats();
+    return ret;
+#else
+    return KDTreeStats();
+#endif // KDTREE_STATS
+}
+
+KDTreeQuality KDTree::getQuality() const {
+    KDTreeQuality quality;
+    quality.nodesBytes = nodes.capacity() * sizeof(KDTreeNode);
+    quality.leavesElementsIndicesBytes = leavesElementsIndices.capacity() * sizeof(unsigned int);
+    quality.leavesBlocksBytes = leavesBlocks.capacity() * sizeof(TriangleBlock);
+    quality.leavesRopesBytes = leavesRopes.capacity() * sizeof(KDTreeLeafRopes);
+
+    // Probabilities of visiting nodes are their surface areas relative to the root's one.
+    std::vector<bool> isTriangleReferenced;
+    std::vector<std::tuple<unsigned int, unsigned int, BBox>> stack = {{0, 0, spaceBounds}};
+    while (!stack.empty()) {
+        auto [nodeIdx, depth, bounds] = stack.back();
+        stack.pop_back();
+        quality.nodesCnt++;
+        float prob = bounds.surfaceArea() / spaceBounds.surfaceArea();
+        const KDTreeNode &node = nodes.at(nodeIdx);
+        if (!node.isLeaf()) {
+            quality.sahCost += traversalCost * prob;
+            BBox belowBounds = bounds, aboveBounds = bounds;
+            belowBounds.replaceUpper(node.getSplitAxis(), node.getSplitPos());
+            aboveBounds.replaceLower(node.getSplitAxis(), node.getSplitPos());
+            stack.push_back({node.getBelowChild(), depth + 1, belowBounds});
+            stack.push_back({node.getAboveChild(), depth + 1, aboveBounds});
+            continue;
+        }
+
+        unsigned int trianglesCnt = node.getTrianglesCnt();
+        quality.leavesCnt++;
+        quality.emptyLeavesCnt += trianglesCnt == 0;
+        quality.sahCost += isectCost * trianglesCnt * prob;
+        unsigned int sizeBucket = trianglesCnt == 0 ? 0 : std::ilogb(trianglesCnt) + 1;
+        if (quality.leafSizesHistogram.size() <= sizeBucket)
+            quality.leafSizesHistogram.resize(sizeBucket + 1);
+        quality.leafSizesHistogram.at(sizeBucket)++;
+        if (quality.leafDepthsHistogram.size() <= depth)
+            quality.leafDepthsHistogram.resize(depth + 1);
+        quality.leafDepthsHistogram.at(depth)++;
+
+        quality.trianglesRefsCnt += trianglesCnt;
+        for (unsigned int i = 0; i < trianglesCnt; i++) {
+            unsigned int trianIdx = leavesElementsIndices.at(node.leavesElementsIndicesOffset + i);
+            if (isTriangleReferenced.size() <= trianIdx)
+                isTriangleReferenced.resize(trianIdx + 1);
+            quality.uniqueTrianglesCnt += !isTriangleReferenced.at(trianIdx);
+            isTriangleReferenced.at(trianIdx) = true;
         }
-        return false;
     }
+    return quality;
+}
 
-    // interior node
-    unsigned int splitAxis = node.getSplitAxis(), firstChildIdx, secondChildIdx;
-    bool below = r.o[splitAxis] < node.getSplitPos() ||
-                 r.o[splitAxis] == node.getSplitPos() && r.d[splitAxis] <= 0;
-    if (below) {
-        firstChildIdx = nodeIdx + 1;
-        secondChildIdx = node.getAboveChild();
-    } else {
-        firstChildIdx = node.getAboveChild();
-        secondChildIdx = nodeIdx + 1;
-    }
-    float tPlane = (node.getSplitPos() - r.o[splitAxis]) / r.d[splitAxis];
-    if (tPlane > r.tMax || tPlane <= 0)
-        return isObstructed(r, target, triangles, vertices, firstChildIdx);
-    else if (tPlane < r.tMin)
-        return isObstructed(r, target, triangles, vertices, secondChildIdx);
-    else {
-        if (isObstructed(Ray(r.o, r.d, r.tMin, tPlane), target, triangles, vertices, firstChildIdx))
+const BBox &KDTree::getSpaceBounds() const { return spaceBounds; }
+
+bool KDTree::isLoadedFromCache() const { return loadedFromCache; }
+
+std::uint64_t KDTree::hashGeometry(const std::vector<Triangle> &triangles,
+                                   const std::vector<Vertex> &vertices) {
+    std::uint64_t h = 0;
+    for (const Triangle &tri : triangles) {
+        std::array<glm::vec3, 3> positions = {vertices.at(tri.indices[0]).pos,
+                                              vertices.at(tri.indices[1]).pos,
+                                              vertices.at(tri.indices[2]).pos};
+        h = hashBytes(positions.data(), sizeof(positions), h);
+    }
+    return h;
+}
+
+float KDTree::getRayRangeBias(const BBox &sceneBounds) {
+    return .00005f * std::sqrt(sceneBounds.dimLength(0) * sceneBounds.dimLength(0) +
+                               sceneBounds.dimLength(1) * sceneBounds.dimLength(1) +
+                               sceneBounds.dimLength(2) * sceneBounds.dimLength(2));
+}
+
+void KDTree::setRayRangeBias(float bias) { rayRangeBias = bias; }
+
+void KDTree::benchmarkLeafKernels(const std::vector<Ray> &rays, std::ostream &os) const {
+    // Gather leaves the rays visit until they find a hit, the same as during rendering.
+    struct LeafVisit {
+        unsigned int rayIdx;
+        KDTreeTodo leaf;
+    };
+    std::vector<LeafVisit> visits;
+    std::vector<KDTreeTodo> leaves;
+    for (unsigned int i = 0; i < rays.size(); i++) {
+        Ray r = rays.at(i);
+        r.o += r.d * rayRangeBias;
+        leaves.clear();
+        findLeaves(r, leaves);
+        for (const KDTreeTodo &leaf : leaves) {
+            visits.push_back({i, leaf});
+            float tNearest = leaf.tMax + rayRangeBias;
+            glm::vec2 baryPos;
+            unsigned int trianIdx;
+            if (intersectLeaf(nodes.at(leaf.nodeIdx), r.o, r.d, leaf.tMin - rayRangeBias,
+                              tNearest, baryPos, trianIdx))
+                break;
+        }
+    }
+
+    unsigned long long trianglesTested = 0;
+    for (const LeafVisit &visit : visits)
+        trianglesTested += nodes.at(visit.leaf.nodeIdx).getTrianglesCnt();
+
+    std::array<std::vector<int>, 2> lanes;
+    std::array<double, 2> times;
+    for (unsigned int scalar = 0; scalar < 2; scalar++) {
+        lanes.at(scalar).reserve(visits.size());
+        auto begin = std::chrono::steady_clock::now();
+        for (const LeafVisit &visit : visits) {
+            const Ray &r = rays[visit.rayIdx];
+            glm::vec3 o = r.o + r.d * rayRangeBias;
+            const KDTreeNode &node = nodes[visit.leaf.nodeIdx];
+            const TriangleBlock *leafBlocks =
+                leavesBlocks.data() + node.leavesElementsIndicesOffset / TriangleBlock::width;
+            unsigned int blocksCnt =
+                (node.getTrianglesCnt() + TriangleBlock::width - 1) / TriangleBlock::width;
+            float tNearest = visit.leaf.tMax + rayRangeBias;
+            glm::vec2 baryPos;
+            int nearest = -1;
+            for (unsigned int i = 0; i < blocksCnt; i++) {
+                int lane =
+                    scalar ? leafBlocks[i].intersectNearestScalar(
+                                 o, r.d, visit.leaf.tMin - rayRangeBias, tNearest, baryPos)
+                           : leafBlocks[i].intersectNearest(o, r.d, visit.leaf.tMin - rayRangeBias,
+                                                            tNearest, baryPos);
+                if (lane != -1)
+                    nearest = i * TriangleBlock::width + lane;
+            }
+            lanes.at(scalar).push_back(nearest);
+        }
+        times.at(scalar) = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                               std::chrono::steady_clock::now() - begin)
+                               .count();
+    }
+
+    unsigned int mismatches = 0;
+    for (unsigned int i = 0; i < visits.size(); i++)
+        mismatches += lanes.at(0).at(i) != lanes.at(1).at(i);
+
+    os << "Leaf kernels (" << TriangleBlock::width << "-wide blocks): " << rays.size() << " rays, "
+       << visits.size() << " leaf visits, " << (double)trianglesTested / visits.size()
+       << " triangles per visited leaf.\n"
+       << "  SIMD:   " << times.at(0) / visits.size() << " ns per leaf\n"
+       << "  scalar: " << times.at(1) / visits.size() << " ns per leaf\n"
+       << "  speedup: " << times.at(1) / times.at(0) << "x, " << mismatches
+       << " mismatching results\n";
+}
+
+bool KDTree::intersectLeaf(const KDTreeNode &node, const glm::vec3 &o, const glm::vec3 &d,
+                           float tMin, float &tMax, glm::vec2 &baryPos, unsigned int &trianIdx,
+                           Mailbox *mailbox) const {
+    const TriangleBlock *leafBlocks =
+        leavesBlocks.data() + node.leavesElementsIndicesOffset / TriangleBlock::width;
+    unsigned int blocksCnt =
+        (node.getTrianglesCnt() + TriangleBlock::width - 1) / TriangleBlock::width;
+    bool hit = false;
+    for (unsigned int i = 0; i < blocksCnt; i++) {
+        // Tested triangles are either missed or not nearer than tMax, so blocks with some
+        // untested triangles are tested whole.
+        if (mailbox != nullptr && !mailbox->markBlock(leafBlocks[i]))
+            continue;
+        KDTREE_STAT(queryStats->trianglesTested += std::min(
+                        TriangleBlock::width, node.getTrianglesCnt() - i * TriangleBlock::width));
+        int lane = leafBlocks[i].intersectNearest(o, d, tMin, tMax, baryPos);
+        if (lane != -1) {
+            trianIdx = leafBlocks[i].trianIdx[lane];
+            hit = true;
+        }
+    }
+    return hit;
+}
+
+bool KDTree::intersectLeafAny(const KDTreeNode &node, const glm::vec3 &o, const glm::vec3 &d,
+                              float tMin, float tMax, Mailbox *mailbox) const {
+    const TriangleBlock *leafBlocks =
+        leavesBlocks.data() + node.leavesElementsIndicesOffset / TriangleBlock::width;
+    unsigned int blocksCnt =
+        (node.getTrianglesCnt() + TriangleBlock::width - 1) / TriangleBlock::width;
+    for (unsigned int i = 0; i < blocksCnt; i++) {
+        if (mailbox != nullptr && !mailbox->markBlock(leafBlocks[i]))
+            continue;
+        KDTREE_STAT(queryStats->trianglesTested += std::min(
+                        TriangleBlock::width, node.getTrianglesCnt() - i * TriangleBlock::width));
+        if (leafBlocks[i].intersectAny(o, d, tMin, tMax))
             return true;
-        else
-            return isObstructed(Ray(r.o, r.d, tPlane, r.tMax), target, triangles, vertices,
-                                secondChildIdx);
+    }
+    return false;
+}
+
+glm::vec3 KDTree::interpolateNormal(unsigned int trianIdx, const glm::vec2 &baryPos,
+                                    const std::vector<Triangle> &triangles,
+                                    const std::vector<Vertex> &vertices) {
+    const Triangle &tri = triangles[trianIdx];
+    const Vertex &a = vertices[tri.indices[0]];
+    const Vertex &b = vertices[tri.indices[1]];
+    const Vertex &c = vertices[tri.indices[2]];
+    return glm::normalize(a.norm + baryPos.x * (b.norm - a.norm) + baryPos.y * (c.norm - a.norm));
+}
+
+bool KDTree::reserveBuildThread() {
+    int idle = idleBuildThreads;
+    while (idle > 0)
+        if (idleBuildThreads.compare_exchange_weak(idle, idle - 1))
+            return true;
+    return false;
+}
+
+void KDTree::createLeafNode(KDTreeBuildRegion &region, unsigned int trianglesCnt,
+                            unsigned int nodeIdx) {
+    region.nodes.at(nodeIdx).initLeaf(trianglesCnt, region.leavesElementsIndices);
+}
+
+unsigned int KDTree::createChildren(KDTreeBuildRegion &region, unsigned int nodeIdx,
+                                    unsigned int axis, float split) {
+    unsigned int belowChildIdx = region.nodes.size();
+    region.nodes.resize(region.nodes.size() + 2);
+    region.nodes.at(nodeIdx).initInterior(axis, split);
+    region.nodes.at(nodeIdx).setBelowChild(belowChildIdx);
+    return belowChildIdx;
+}
+
+void KDTree::layoutTreelets(const std::vector<KDTreeNode> &buildNodes) {
+    // Children of a node are visited with probability proportional to its surface area.
+    std::vector<float> areas(buildNodes.size());
+    std::vector<std::pair<unsigned int, BBox>> stack = {{0, spaceBounds}};
+    while (!stack.empty()) {
+        auto [nodeIdx, bounds] = stack.back();
+        stack.pop_back();
+        areas.at(nodeIdx) = bounds.surfaceArea();
+        const KDTreeNode &node = buildNodes.at(nodeIdx);
+        if (node.isLeaf())
+            continue;
+        BBox belowBounds = bounds, aboveBounds = bounds;
+        belowBounds.replaceUpper(node.getSplitAxis(), node.getSplitPos());
+        aboveBounds.replaceLower(node.getSplitAxis(), node.getSplitPos());
+        stack.push_back({node.getBelowChild(), belowBounds});
+        stack.push_back({node.getAboveChild(), aboveBounds});
+    }
+
+    // Root shares the first cache line with an unused node, so that every sibling pair starts at
+    // an even index and never crosses cache line boundary.
+    constexpr unsigned int pairsPerLine = cacheLineSize / sizeof(KDTreeNode) / 2;
+    nodes.reserve(buildNodes.size() + 1);
+    nodes.resize(2);
+    nodes.at(0) = buildNodes.at(0);
+    nodes.at(1).initLeaf(0, leavesElementsIndices);
+    std::vector<unsigned int> newIndices(buildNodes.size());
+    newIndices.at(0) = 0;
+
+    // Treelets are identified by the parent of their first sibling pair and laid out depth-first.
+    auto byArea = [&](unsigned int n1, unsigned int n2) { return areas.at(n1) < areas.at(n2); };
+    std::vector<unsigned int> treeletsParents, candidates;
+    if (!buildNodes.at(0).isLeaf())
+        treeletsParents.push_back(0);
+    while (!treeletsParents.empty()) {
+        candidates = {treeletsParents.back()};
+        treeletsParents.pop_back();
+        unsigned int freePairs = pairsPerLine - nodes.size() / 2 % pairsPerLine;
+        for (; freePairs > 0 && !candidates.empty(); freePairs--) {
+            std::pop_heap(candidates.begin(), candidates.end(), byArea);
+            unsigned int belowChildIdx = buildNodes.at(candidates.back()).getBelowChild();
+            candidates.pop_back();
+            for (unsigned int childIdx = belowChildIdx; childIdx < belowChildIdx + 2; childIdx++) {
+                newIndices.at(childIdx) = nodes.size();
+                nodes.push_back(buildNodes.at(childIdx));
+                if (!buildNodes.at(childIdx).isLeaf()) {
+                    candidates.push_back(childIdx);
+                    std::push_heap(candidates.begin(), candidates.end(), byArea);
+                }
+            }
+        }
+        // The most probable of the remaining children is laid out next.
+        std::sort(candidates.begin(), candidates.end(), byArea);
+        treeletsParents.insert(treeletsParents.end(), candidates.begin(), candidates.end());
+    }
+
+    for (KDTreeNode &node : nodes)
+        if (!node.isLeaf())
+            node.setBelowChild(newIndices.at(node.getBelowChild()));
+}
+
+void KDTree::setTraversal(KDTreeTraversal traversal) {
+    if (traversal == KDTreeTraversal::Ropes && leavesRopes.empty())
+        buildRopes();
+    this->traversal = traversal;
+}
+
+void KDTree::buildRopes() {
+    // Popov et al. 2007, "Stackless KD-Tree Traversal for High Performance GPU Ray Tracing".
+    struct RopesTodo {
+        unsigned int nodeIdx;
+        BBox bounds;
+        std::array<unsigned int, 6> ropes;
+    };
+
+    leavesRopes.resize(nodes.size());
+    std::vector<RopesTodo> todo = {{0, spaceBounds, {~0u, ~0u, ~0u, ~0u, ~0u, ~0u}}};
+    while (!todo.empty()) {
+        RopesTodo cur = todo.back();
+        todo.pop_back();
+
+        // Push ropes down to the smallest nodes still containing whole faces.
+        for (unsigned int face = 0; face < 6; face++) {
+            unsigned int &rope = cur.ropes.at(face);
+            unsigned int faceAxis = face / 2;
+            float facePos = cur.bounds.axesBounds.at(faceAxis)[face % 2];
+            while (rope != ~0u && !nodes.at(rope).isLeaf()) {
+                const KDTreeNode &node = nodes.at(rope);
+                unsigned int axis = node.getSplitAxis();
+                if (axis == faceAxis) {
+                    if (face % 2 == 1)
+                        rope = node.getSplitPos() > facePos ? node.getBelowChild()
+                                                            : node.getAboveChild();
+                    else
+                        rope = node.getSplitPos() < facePos ? node.getAboveChild()
+                                                            : node.getBelowChild();
+                } else if (node.getSplitPos() >= cur.bounds.axesBounds.at(axis)[1])
+                    rope = node.getBelowChild();
+                else if (node.getSplitPos() <= cur.bounds.axesBounds.at(axis)[0])
+                    rope = node.getAboveChild();
+                else
+                    break;
+            }
+        }
+
+        const KDTreeNode &node = nodes.at(cur.nodeIdx);
+        if (node.isLeaf()) {
+            leavesRopes.at(cur.nodeIdx) = {cur.bounds, cur.ropes};
+            continue;
+        }
+        unsigned int axis = node.getSplitAxis();
+        RopesTodo below = cur, above = cur;
+        below.nodeIdx = node.getBelowChild();
+        below.bounds.replaceUpper(axis, node.getSplitPos());
+        below.ropes.at(2 * axis + 1) = node.getAboveChild();
+        above.nodeIdx = node.getAboveChild();
+        above.bounds.replaceLower(axis, node.getSplitPos());
+        above.ropes.at(2 * axis) = node.getBelowChild();
+        todo.push_back(below);
+        todo.push_back(above);
+    }
+}
+
+void KDTree::findLeaves(Ray r, std::vector<KDTreeTodo> &leaves) const {
+    float tMin, tMax;
+    if (!spaceBounds.intersect(r, tMin, tMax))
+        return;
+    walkStack(r, 0, tMin, tMax, [&](unsigned int leafIdx, float leafTMin, float leafTMax) {
+        leaves.push_back({leafIdx, leafTMin, leafTMax});
+        return false;
+    });
+}
+
+template <typename F>
+void KDTree::walkStack(const Ray &r, unsigned int nodeIdx, float tMin, float tMax,
+                       F visitLeaf) const {
+    KDTreeTodo todo[maxTodo];
+    unsigned int todoPos = 0;
+    while (true) {
+        const KDTreeNode &node = nodes[nodeIdx];
+        KDTREE_STAT(queryStats->nodesVisited++);
+
+        if (node.isLeaf()) {
+            KDTREE_STAT(queryStats->leavesVisited++);
+            if (visitLeaf(nodeIdx, tMin, tMax) || todoPos == 0)
+                return;
+            todoPos--;
+            nodeIdx = todo[todoPos].nodeIdx;
+            tMin = todo[todoPos].tMin;
+            tMax = todo[todoPos].tMax;
+            continue;
+        }
+
+        // interior node
+        unsigned int splitAxis = node.getSplitAxis(), firstChildIdx, secondChildIdx;
+        bool below = r.o[splitAxis] < node.getSplitPos() ||
+                     r.o[splitAxis] == node.getSplitPos() && r.d[splitAxis] <= 0;
+        if (below) {
+            firstChildIdx = node.getBelowChild();
+            secondChildIdx = node.getAboveChild();
+        } else {
+            firstChildIdx = node.getAboveChild();
+            secondChildIdx = node.getBelowChild();
+        }
+        float tPlane = (node.getSplitPos() - r.o[splitAxis]) / r.d[splitAxis];
+        if (tPlane > tMax || tPlane <= 0)
+            nodeIdx = firstChildIdx;
+        else if (tPlane < tMin)
+            nodeIdx = secondChildIdx;
+        else {
+            todo[todoPos++] = {secondChildIdx, tPlane, tMax};
+            nodeIdx = firstChildIdx;
+            tMax = tPlane;
+        }
     }
 }
 
-void KDTree::createLeafNode(const std::vector<unsigned int> &trianglesIndices,
-                            unsigned int parentNodeIdx, bool aboveSplit) {
-    KDTreeNode node;
-    node.initLeaf(trianglesIndices, leavesElementsIndices);
-    nodes.push_back(node);
-    if (parentNodeIdx != ~0u && aboveSplit)
-        nodes.at(parentNodeIdx).setAboveChild(nodes.size() - 1);
+template <typename F>
+bool KDTree::walkRopes(const Ray &r, unsigned int nodeIdx, float tMin, float tMax,
+                       F visitLeaf) const {
+    // tMin never decreases, so rounding errors can make the walk cycle only through leaves it
+    // enters at the same tMin. Returning to such a leaf is detected as in Brent's algorithm, by
+    // comparing with the leaf saved after each power of 2 steps without progress.
+    unsigned int stalledSteps = 0, savedLeaf = ~0u;
+    while (true) {
+        // Locate the leaf containing the entry point, resolving ties in the direction of the ray.
+        glm::vec3 p = r.o + tMin * r.d;
+        while (!nodes[nodeIdx].isLeaf()) {
+            const KDTreeNode &node = nodes[nodeIdx];
+            KDTREE_STAT(queryStats->nodesVisited++);
+            unsigned int axis = node.getSplitAxis();
+            bool below = p[axis] < node.getSplitPos() ||
+                         p[axis] == node.getSplitPos() && r.d[axis] <= 0;
+            nodeIdx = below ? node.getBelowChild() : node.getAboveChild();
+        }
+        KDTREE_STAT(queryStats->nodesVisited++; queryStats->leavesVisited++);
+        if (nodeIdx == savedLeaf)
+            return false;
+        stalledSteps++;
+        if ((stalledSteps & (stalledSteps - 1)) == 0)
+            savedLeaf = nodeIdx;
+
+        // Find the face through which the ray leaves the leaf.
+        const KDTreeLeafRopes &leaf = leavesRopes[nodeIdx];
+        float tExit = tMax;
+        unsigned int exitFace = ~0u;
+        for (unsigned int axis = 0; axis < 3; axis++) {
+            if (r.d[axis] == 0.f)
+                continue;
+            unsigned int upper = r.d[axis] > 0.f;
+            float t = (leaf.bounds.axesBounds[axis][upper] - r.o[axis]) / r.d[axis];
+            if (t < tExit) {
+                tExit = t;
+                exitFace = 2 * axis + upper;
+            }
+        }
+
+        if (visitLeaf(nodeIdx, tMin, tExit) || exitFace == ~0u)
+            return true;
+        nodeIdx = leaf.ropes[exitFace];
+        if (nodeIdx == ~0u)
+            return true; // left the scene
+        if (tExit > tMin) {
+            tMin = tExit;
+            stalledSteps = 0;
+            savedLeaf = ~0u;
+        }
+    }
 }
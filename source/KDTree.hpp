@@ -5,12 +5,25 @@
 
 #pragma once
 
+#include "AlignedAllocator.hpp"
+#include "Arena.hpp"
 #include "BBox.hpp"
 #include "BoundEdge.hpp"
+#include "Frustum.hpp"
+#include "KDTreeQuality.hpp"
+#include "KDTreeStats.hpp"
 #include "Light.hpp"
+#include "Mailbox.hpp"
 #include "Mesh.hpp"
 #include "Ray.hpp"
+#include "RayPacket.hpp"
+#include "TriangleBlock.hpp"
 
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <string>
 #include <vector>
 
 struct KDTreeNode {
@@ -25,61 +38,374 @@ struct KDTreeNode {
         unsigned int trianglesCnt; // leaf
         /**
          * Encoded on bits 31--2.
-         * Stores index of the child node in nodes vector above the splitting plane.
-         * The child node below the splitting plane is just after the current one
-         * in the nodes array.
+         * Stores index of the child node in nodes vector below the splitting plane.
+         * The child node above the splitting plane is just after it, so that siblings
+         * never lie in different cache lines.
          */
-        unsigned int aboveChild; // interior
+        unsigned int belowChild; // interior
     };
 
-    void initLeaf(const std::vector<unsigned int> &trianglesIndices,
-                  std::vector<unsigned int> &leavesElementsIndices);
+    /**
+     * @brief Make the node a leaf of the last trianglesCnt elements of leavesElementsIndices.
+     */
+    void initLeaf(unsigned int trianglesCnt, std::vector<unsigned int> &leavesElementsIndices);
     void initInterior(unsigned int axis, float split);
     float getSplitPos() const;
     unsigned int getTrianglesCnt() const;
     unsigned int getSplitAxis() const;
     bool isLeaf() const;
+    unsigned int getBelowChild() const;
     unsigned int getAboveChild() const;
-    void setAboveChild(unsigned int idx);
+    void setBelowChild(unsigned int idx);
+};
+
+/**
+ * Part of the tree being built by a single thread. Its first node is the root of the subtree and
+ * the other ones, as well as leaves' offsets, are numbered from the start of the region.
+ */
+struct KDTreeBuildRegion {
+    std::vector<KDTreeNode> nodes;
+    std::vector<unsigned int> leavesElementsIndices;
+    /* Scratch memory of nodes at even and odd depths. Data for children goes to the other arena
+     * than node's own, so that the latter can be released before building the subtrees. */
+    std::array<Arena, 2> arenas;
+    /* Zeroed scratch space with an element per triangle, empty unless building with SAH. */
+    std::vector<unsigned char> trianglesSides;
+
+    /**
+     * @brief Append nodes of a subtree built separately, making its root the node at nodeIdx.
+     * Gives the same result as building the subtree in this region at this point.
+     */
+    void splice(unsigned int nodeIdx, const KDTreeBuildRegion &subtree);
+};
+
+/**
+ * Triangle of a node being built with binned SAH together with its bounds, which are thus read
+ * sequentially.
+ */
+struct KDTreeBuildRef {
+    BBox bounds;
+    unsigned int trianIdx;
+};
+
+/**
+ * Node still to be visited during traversal together with ray's parametric range inside it.
+ */
+struct KDTreeTodo {
+    unsigned int nodeIdx;
+    float tMin, tMax;
+};
+
+/**
+ * Node at which traversal of rays of a frustum may start, together with its bounds.
+ */
+struct KDTreeEntryPoint {
+    unsigned int nodeIdx;
+    BBox bounds;
+};
+
+/**
+ * Leaf's bounds and its neighbours for stackless traversal.
+ */
+struct KDTreeLeafRopes {
+    BBox bounds;
+    /* Smallest nodes containing whole lower (2 * axis) and upper (2 * axis + 1) faces of the leaf
+     * from the other side. ~0u for faces lying on scene bounds. */
+    std::array<unsigned int, 6> ropes;
+};
+
+enum class KDTreeTraversal {
+    /* Visit leaves using a stack of nodes still to be visited. */
+    Stack,
+    /* Move from leaf to leaf following ropes. */
+    Ropes
+};
+
+/**
+ * Parameters of tree construction, see KDTree constructor.
+ */
+struct KDTreeParams {
+    unsigned int maxDepth;
+    unsigned int maxLeafCapacity = 16;
+    float emptyBonus = 0.f;
+    float traversalCost = 1.f;
+    float isectCost = 80.f;
+
+    /**
+     * @brief maxDepth growing with the number of triangles the tree is built for.
+     */
+    static unsigned int defaultMaxDepth(unsigned int trianglesCnt);
+    bool operator==(const KDTreeParams &other) const;
+};
+
+enum class KDTreeBuild {
+    /* Exact SAH, evaluated at every edge of triangles' bounds. */
+    SAH,
+    /* SAH evaluated at boundaries of KDTree::binsCnt equal bins per axis, without sorting. Builds
+     * faster, but the tree is slower to traverse. */
+    BinnedSAH
 };
 
 class KDTree {
 public:
+    /* Upper bound for tree depth and thus for traversal stack size. */
+    static constexpr unsigned int maxTodo = 64;
+    static constexpr unsigned int cacheLineSize = 64;
+    /* Nodes with fewer triangles are built by a single thread. */
+    static constexpr unsigned int minParallelBuildCnt = 1 << 14;
+    /* Number of bins per axis in binned SAH build. */
+    static constexpr unsigned int binsCnt = 32;
+    /* Share of probabilities of visiting nodes coming from the fraction of ray hits inside them
+     * rather than from their surface areas, when a build is given ray hits. */
+    static constexpr float rayHitsWeight = .5f;
+    /* Version of cache files. Has to be incremented whenever their layout or the tree built for
+     * the same input and parameters changes. */
+    static constexpr std::uint32_t cacheVersion = 1;
+
+    /**
+     * @param buildThreads Number of threads the tree may be built with. The tree does not depend
+     * on it.
+     * @param cachePath File the tree is loaded from if it was saved there for the same triangles,
+     * vertices and build parameters. Otherwise the tree is built and saved there. Empty disables
+     * caching.
+     * @param rayHits Points where a sample of the rays to be traced hit the scene. SAH build
+     * weights probabilities of visiting nodes by them, tuning the tree to these rays. Ignored by
+     * binned SAH build.
+     * @param verbose Whether to report loading from cachePath and the ray range bias on
+     * std::cerr.
+     */
     KDTree(const std::vector<Triangle> &triangles, const std::vector<Vertex> &vertices,
            unsigned int maxDepth, unsigned int maxLeafCapacity, float emptyBonus,
-           float traversalCost, float isectCost);
+           float traversalCost, float isectCost, unsigned int buildThreads = 1,
+           KDTreeBuild build = KDTreeBuild::SAH, const std::string &cachePath = "",
+           const std::vector<glm::vec3> &rayHits = {}, bool verbose = true);
     bool findNearestIntersection(Ray r, const std::vector<Triangle> &triangles,
                                  const std::vector<Vertex> &vertices, float &t, glm::vec3 &n,
                                  unsigned int &trianIdx) const;
-    bool isObstructed(Ray r, const float target, const std::vector<Triangle> &triangles,
-                      const std::vector<Vertex> &vertices) const;
+    /**
+     * @brief Same as above for a ray lying inside the frustum entry was found for, starting
+     * traversal at the entry point instead of the root.
+     */
+    bool findNearestIntersection(Ray r, const std::vector<Triangle> &triangles,
+                                 const std::vector<Vertex> &vertices, float &t, glm::vec3 &n,
+                                 unsigned int &trianIdx, const KDTreeEntryPoint &entry) const;
+    /**
+     * @brief Find closest hits of packet's rays, stepping through the tree with the whole packet
+     * at once. Gives the same results as findNearestIntersection called for each ray. Rays are
+     * traced one by one if they disagree on the order of children at some node.
+     */
+    void findNearestIntersections(const RayPacket &packet, const std::vector<Triangle> &triangles,
+                                  const std::vector<Vertex> &vertices, RayPacketHits &hits) const;
+    /**
+     * @brief Same as above for a packet lying inside the frustum entry was found for.
+     */
+    void findNearestIntersections(const RayPacket &packet, const std::vector<Triangle> &triangles,
+                                  const std::vector<Vertex> &vertices, RayPacketHits &hits,
+                                  const KDTreeEntryPoint &entry) const;
+    /**
+     * @brief Find the deepest node containing all leaves that rays of the frustum can visit, by
+     * descending from the root as long as the frustum excludes one of node's children.
+     * Rays of the frustum then skip the top of the tree they would all go through anyway.
+     */
+    KDTreeEntryPoint findEntryPoint(const Frustum &frustum) const;
+    /**
+     * @brief Any-hit query for the segment between r.o + r.tMin * r.d and r.o + r.tMax * r.d.
+     * Traversal stops at the segment's end and at the first hit found. Hits closer than
+     * 2 * rayRangeBias to either end are ignored, as these are the surfaces the segment connects.
+     */
+    bool isObstructed(Ray r) const;
+    /**
+     * @brief Any-hit query for a batch of segments.
+     * @param obstructed Array of cnt elements. i-th is set to the result for rays[i].
+     */
+    void isObstructed(const Ray *rays, unsigned int cnt, bool *obstructed) const;
+    /**
+     * @brief Select how single ray queries find leaves pierced by the ray. Ropes are built on
+     * first use. Packets are always traversed with a stack.
+     */
+    void setTraversal(KDTreeTraversal traversal);
+    /**
+     * @brief Get and reset calling thread's counts of triangle tests done and skipped thanks to
+     * mailboxing in single ray queries.
+     */
+    static void takeMailboxStats(unsigned long long &testedCnt, unsigned long long &skippedCnt);
+    /**
+     * @brief Get and reset calling thread's traversal counters. All zero unless compiled with
+     * KDTREE_STATS defined.
+     */
+    static KDTreeStats takeStats();
+    /**
+     * @brief Summarize the structure of the tree. Takes time linear in its size.
+     */
+    KDTreeQuality getQuality() const;
+    const BBox &getSpaceBounds() const;
+    /**
+     * @return Whether the tree was loaded from its cache file rather than built.
+     */
+    bool isLoadedFromCache() const;
+    /**
+     * @return Hash of positions of triangles' vertices. It does not depend on where they are
+     * stored, so it identifies a mesh across edits of other meshes.
+     */
+    static std::uint64_t hashGeometry(const std::vector<Triangle> &triangles,
+                                      const std::vector<Vertex> &vertices);
+    /**
+     * @return Distance rays are offset by to avoid hitting surfaces they start at, for a scene
+     * of given bounds. Trees use the one of their own bounds by default.
+     */
+    static float getRayRangeBias(const BBox &sceneBounds);
+    /**
+     * @brief Use the bias of a scene the tree is a part of.
+     */
+    void setRayRangeBias(float bias);
+    /**
+     * @brief Time SIMD and scalar leaf intersection kernels on leaves visited by given rays.
+     */
+    void benchmarkLeafKernels(const std::vector<Ray> &rays, std::ostream &os) const;
 
 private:
+    /* Each leaf's part is padded with ~0u to a multiple of TriangleBlock::width. */
     std::vector<unsigned int> leavesElementsIndices;
+    /* Intersection data of triangles referenced by leavesElementsIndices, in the same order.
+     * Leaf's blocks start at leavesElementsIndicesOffset / TriangleBlock::width. */
+    std::vector<TriangleBlock> leavesBlocks;
     const unsigned int maxLeafCapacity;
     const unsigned int maxDepth;
-    std::vector<KDTreeNode> nodes;
+    /* Grouped into treelets filling whole cache lines, see layoutTreelets. */
+    std::vector<KDTreeNode, AlignedAllocator<KDTreeNode, cacheLineSize>> nodes;
     BBox spaceBounds;
     const float emptyBonus;
     const float traversalCost;
     const float isectCost;
     float rayRangeBias;
+    bool loadedFromCache = false;
+    KDTreeTraversal traversal = KDTreeTraversal::Stack;
+    /* Ropes of leaf nodes at their indices, empty until rope traversal is selected. */
+    std::vector<KDTreeLeafRopes> leavesRopes;
+    /* Number of threads that may still be started while building. Negative while threads
+     * waiting for their subtrees to be built finish their work. */
+    std::atomic<int> idleBuildThreads;
 
+    /**
+     * @brief Build nodes and leavesElementsIndices and extend spaceBounds to all triangles.
+     */
+    void buildTree(const std::vector<Triangle> &triangles, const std::vector<Vertex> &vertices,
+                   unsigned int maxDepth, KDTreeBuild build, const std::vector<glm::vec3> &rayHits);
+    /**
+     * @brief Read nodes, leavesElementsIndices, spaceBounds and rayRangeBias from a memory-mapped
+     * cache file.
+     * @param key Hash of the input the tree is built for.
+     * @return false, leaving the tree intact, if the file is missing, corrupt or saved for
+     * another input or version.
+     */
+    bool loadCache(const std::string &path, std::uint64_t key);
+    /**
+     * @brief Write the tree to a cache file. Failures are only reported.
+     */
+    void saveCache(const std::string &path, std::uint64_t key) const;
     /**
      * @param axis 0, 1 or 2 (x, y or z respectively).
      */
-    void buildTreeSAH(const std::vector<unsigned int> &trianglesIndices, unsigned int depth,
-                      unsigned int parentNodeIdx, bool aboveSplit, const BBox &nodeBounds,
-                      const std::vector<BBox> &trianglesBounds,
-                      std::array<std::vector<BoundEdge>, 3> &edges, unsigned int badRefines);
-    void buildTreeHalfSplits(std::vector<unsigned int> &trianglesIndices, unsigned int depth,
-                             unsigned int parentNodeIdx, bool aboveSplit, const BBox &nodeBounds,
+    /**
+     * @brief Subtrees of large nodes are built by separate threads in regions of their own, which
+     * are then spliced into the region, so that the result does not depend on the number of
+     * threads.
+     * Triangles overlapping both children are clipped to their bounds.
+     * @param edges Edges of node's triangles' bounds clipped to the node along every axis, sorted,
+     * allocated in region's arena for the depth.
+     * @param hits Ray hits inside the node sorted along every axis, allocated after edges.
+     * @param edgesMark Mark of the arena taken before allocating edges. The arena is released to it
+     * before building the subtrees.
+     */
+    void buildTreeSAH(KDTreeBuildRegion &region, std::array<ArenaVector<BoundEdge>, 3> &edges,
+                      std::array<ArenaVector<glm::vec3>, 3> &hits, const Arena::Mark &edgesMark,
+                      unsigned int depth, unsigned int nodeIdx, const BBox &nodeBounds,
+                      const std::vector<Triangle> &triangles, const std::vector<Vertex> &vertices,
+                      unsigned int badRefines);
+    /**
+     * @brief Same as buildTreeSAH, but considering only splits at bins' boundaries.
+     * @param refs Node's triangles, allocated in region's arena for the depth.
+     * @param refsMark Mark of the arena taken before allocating refs.
+     */
+    void buildTreeBinnedSAH(KDTreeBuildRegion &region, ArenaVector<KDTreeBuildRef> &refs,
+                            const Arena::Mark &refsMark, unsigned int depth, unsigned int nodeIdx,
+                            const BBox &nodeBounds, unsigned int badRefines);
+    void buildTreeHalfSplits(KDTreeBuildRegion &region, ArenaVector<unsigned int> &trianglesIndices,
+                             const Arena::Mark &trianglesIndicesMark, unsigned int depth,
+                             unsigned int nodeIdx, const BBox &nodeBounds,
                              const std::vector<BBox> &trianglesBounds);
-    bool findNearestIntersection(Ray r, const std::vector<Triangle> &triangles,
-                                 const std::vector<Vertex> &vertices, unsigned int nodeIdx,
-                                 float &t, glm::vec3 &n, unsigned int &trianIdx) const;
-    bool isObstructed(Ray r, const float target, const std::vector<Triangle> &triangles,
-                      const std::vector<Vertex> &vertices, unsigned int nodeIdx) const;
-    void createLeafNode(const std::vector<unsigned int> &trianglesIndices,
-                        unsigned int parentNodeIdx, bool aboveSplit);
+    /**
+     * @brief SAH cost of splitting the node.
+     */
+    float splitCost(const BBox &nodeBounds, unsigned int axis, float split,
+                    unsigned int trianglesBelowCnt, unsigned int trianglesAboveCnt,
+                    unsigned int hitsBelowCnt = 0, unsigned int hitsAboveCnt = 0) const;
+    /**
+     * @brief Build subtrees of node's children. If parallel is true and a thread is available, the
+     * above subtree is built by a new thread and spliced into the region afterwards.
+     * @param buildChild Called with a region, index of the child in it and whether it is the
+     * above child built by a new thread.
+     */
+    template <typename F>
+    void buildChildren(KDTreeBuildRegion &region, unsigned int belowChildIdx, bool parallel,
+                       F buildChild);
+    /**
+     * @return true if a build thread may be started. It has to increment idleBuildThreads when
+     * done.
+     */
+    bool reserveBuildThread();
+    /**
+     * @brief Make the node a leaf of the last trianglesCnt triangles appended to region's
+     * leavesElementsIndices.
+     */
+    void createLeafNode(KDTreeBuildRegion &region, unsigned int trianglesCnt, unsigned int nodeIdx);
+    /**
+     * @brief Allocate children of an interior node as a pair of sibling nodes.
+     * @return Index of the child below the splitting plane.
+     */
+    unsigned int createChildren(KDTreeBuildRegion &region, unsigned int nodeIdx,
+                                unsigned int axis, float split);
+    /**
+     * @brief Reorder nodes into cache line sized treelets.
+     * Starting from a sibling pair, a treelet is greedily grown with children of its nodes that
+     * are the most likely to be visited, i.e. having the largest surface area, until it fills the
+     * rest of the cache line. Children left out start treelets of their own.
+     * @param buildNodes Nodes in the order they were built in.
+     */
+    void layoutTreelets(const std::vector<KDTreeNode> &buildNodes);
+    void buildRopes();
+    /**
+     * @brief Find all leaves pierced by the ray in front-to-back order without testing any
+     * triangles.
+     */
+    void findLeaves(Ray r, std::vector<KDTreeTodo> &leaves) const;
+    /**
+     * @brief Visit leaves of nodeIdx's subtree pierced by the ray between tMin and tMax in
+     * front-to-back order.
+     * @param visitLeaf Called with leaf's index and ray's range inside it. Returns true to stop.
+     */
+    template <typename F>
+    void walkStack(const Ray &r, unsigned int nodeIdx, float tMin, float tMax, F visitLeaf) const;
+    /**
+     * @brief Same as walkStack, following ropes instead of keeping a stack.
+     * @return false if the walk was given up because of rounding errors before reaching tMax.
+     */
+    template <typename F>
+    bool walkRopes(const Ray &r, unsigned int nodeIdx, float tMin, float tMax, F visitLeaf) const;
+    /**
+     * @brief Find nearest hit among leaf's triangles with t in (tMin, tMax).
+     * @param tMax Updated with distance to the found hit.
+     * @param mailbox If not nullptr, triangles already tested against the ray are skipped.
+     */
+    bool intersectLeaf(const KDTreeNode &node, const glm::vec3 &o, const glm::vec3 &d, float tMin,
+                       float &tMax, glm::vec2 &baryPos, unsigned int &trianIdx,
+                       Mailbox *mailbox = nullptr) const;
+    /**
+     * @return true if any of leaf's triangles is hit with t in (tMin, tMax).
+     */
+    bool intersectLeafAny(const KDTreeNode &node, const glm::vec3 &o, const glm::vec3 &d,
+                          float tMin, float tMax, Mailbox *mailbox = nullptr) const;
+    static glm::vec3 interpolateNormal(unsigned int trianIdx, const glm::vec2 &baryPos,
+                                       const std::vector<Triangle> &triangles,
+                                       const std::vector<Vertex> &vertices);
 };
@@ -0,0 +1,27 @@
+#include "KDTreeAccelerator.hpp"
+
+KDTreeAccelerator::KDTreeAccelerator(std::unique_ptr<KDTree> tree,
+                                     const std::vector<Triangle> &triangles,
+                                     const std::vector<Vertex> &vertices)
+    : tree(std::move(tree)), triangles(triangles), vertices(vertices) {}
+
+bool KDTreeAccelerator::findNearestIntersection(const Ray &r, float &t, glm::vec3 &n,
+                                                unsigned int &trianIdx) const {
+    return tree->findNearestIntersection(r, triangles, vertices, t, n, trianIdx);
+}
+
+void KDTreeAccelerator::findNearestIntersections(const RayPacket &packet, const Frustum &frustum,
+                                                 RayPacketHits &hits) const {
+    tree->findNearestIntersections(packet, triangles, vertices, hits,
+                                   tree->findEntryPoint(frustum));
+}
+
+bool KDTreeAccelerator::isObstructed(const Ray &r) const { return tree->isObstructed(r); }
+
+void KDTreeAccelerator::isObstructed(const Ray *rays, unsigned int cnt, bool *obstructed) const {
+    tree->isObstructed(rays, cnt, obstructed);
+}
+
+void KDTreeAccelerator::printStats(std::ostream &os) const { os << tree->getQuality(); }
+
+KDTree &KDTreeAccelerator::getTree() const { return *tree; }
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "Accelerator.hpp"
+#include "KDTree.hpp"
+
+#include <memory>
+#include <vector>
+
+/**
+ * @brief Accelerator backed by a single KDTree, tracing packets from entry points of their
+ * frustums.
+ */
+class KDTreeAccelerator : public Accelerator {
+public:
+    KDTreeAccelerator(std::unique_ptr<KDTree> tree, const std::vector<Triangle> &triangles,
+                      const std::vector<Vertex> &vertices);
+    bool findNearestIntersection(const Ray &r, float &t, glm::vec3 &n,
+                                 unsigned int &trianIdx) const override;
+    void findNearestIntersections(const RayPacket &packet, const Frustum &frustum,
+                                  RayPacketHits &hits) const override;
+    bool isObstructed(const Ray &r) const override;
+    void isObstructed(const Ray *rays, unsigned int cnt, bool *obstructed) const override;
+    void printStats(std::ostream &os) const override;
+    KDTree &getTree() const;
+
+private:
+    std::unique_ptr<KDTree> tree;
+    const std::vector<Triangle> &triangles;
+    const std::vector<Vertex> &vertices;
+};
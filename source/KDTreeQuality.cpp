@@ -0,0 +1,38 @@
+#include "KDTreeQuality.hpp"
+
+#include <algorithm>
+
+static void printHistogram(std::ostream &os, const std::vector<unsigned int> &histogram,
+                           bool powersOf2) {
+    for (unsigned int i = 0; i < histogram.size(); i++) {
+        if (histogram[i] == 0)
+            continue;
+        os << ' ';
+        if (powersOf2 && i > 1)
+            os << (1u << (i - 1)) << '-' << (1u << i) - 1;
+        else
+            os << i;
+        os << ": " << histogram[i];
+    }
+    os << '\n';
+}
+
+std::ostream &operator<<(std::ostream &os, const KDTreeQuality &quality) {
+    double leaves = std::max(1u, quality.leavesCnt);
+    os << "Nodes: " << quality.nodesCnt << ", leaves: " << quality.leavesCnt << ", empty leaves: "
+       << 100. * quality.emptyLeavesCnt / leaves << "%\n"
+       << "Leaves by number of triangles:";
+    printHistogram(os, quality.leafSizesHistogram, true);
+    os << "Leaves by depth:";
+    printHistogram(os, quality.leafDepthsHistogram, false);
+    os << "Triangle references: " << quality.trianglesRefsCnt << " of "
+       << quality.uniqueTrianglesCnt << " unique triangles ("
+       << (double)quality.trianglesRefsCnt / std::max(1u, quality.uniqueTrianglesCnt)
+       << " per triangle)\n"
+       << "SAH cost: " << quality.sahCost << '\n'
+       << "Memory: nodes " << quality.nodesBytes / 1024. << " KiB, leaves' triangle indices "
+       << quality.leavesElementsIndicesBytes / 1024. << " KiB, leaves' triangle blocks "
+       << quality.leavesBlocksBytes / 1024. << " KiB, ropes " << quality.leavesRopesBytes / 1024.
+       << " KiB\n";
+    return os;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+#include <ostream>
+#include <vector>
+
+/**
+ * @brief Summary of KDTree's structure for telling a badly built tree from slow shading.
+ */
+struct KDTreeQuality {
+    unsigned int nodesCnt = 0;
+    unsigned int leavesCnt = 0;
+    unsigned int emptyLeavesCnt = 0;
+    /* Number of leaves with 0, 1, 2--3, 4--7, ... triangles. */
+    std::vector<unsigned int> leafSizesHistogram;
+    /* Number of leaves at each depth, the root being at depth 0. */
+    std::vector<unsigned int> leafDepthsHistogram;
+    /* Triangles summed over all leaves. */
+    unsigned long long trianglesRefsCnt = 0;
+    /* Triangles in at least one leaf. */
+    unsigned int uniqueTrianglesCnt = 0;
+    /* Expected cost of tracing a ray hitting the scene bounds according to the SAH model, with
+     * the build's traversal and intersection costs. */
+    float sahCost = 0.f;
+    /* Memory allocated for each array of the tree, in bytes. */
+    std::size_t nodesBytes = 0;
+    std::size_t leavesElementsIndicesBytes = 0;
+    std::size_t leavesBlocksBytes = 0;
+    std::size_t leavesRopesBytes = 0;
+
+    friend std::ostream &operator<<(std::ostream &os, const KDTreeQuality &quality);
+};
@@ -0,0 +1,33 @@
+#include "KDTreeStats.hpp"
+
+#include <algorithm>
+
+KDTreeQueryStats &KDTreeQueryStats::operator+=(const KDTreeQueryStats &rhs) {
+    queries += rhs.queries;
+    hits += rhs.hits;
+    nodesVisited += rhs.nodesVisited;
+    leavesVisited += rhs.leavesVisited;
+    trianglesTested += rhs.trianglesTested;
+    return *this;
+}
+
+KDTreeStats &KDTreeStats::operator+=(const KDTreeStats &rhs) {
+    closest += rhs.closest;
+    shadow += rhs.shadow;
+    return *this;
+}
+
+static void printQueryStats(std::ostream &os, const char *name, const KDTreeQueryStats &stats) {
+    double queries = std::max(1ull, stats.queries);
+    os << name << ": " << stats.queries << " queries, " << stats.hits << " hits, "
+       << stats.queries - stats.hits << " misses\n"
+       << "  per query: " << stats.nodesVisited / queries << " nodes, "
+       << stats.leavesVisited / queries << " leaves, " << stats.trianglesTested / queries
+       << " triangles tested\n";
+}
+
+std::ostream &operator<<(std::ostream &os, const KDTreeStats &stats) {
+    printQueryStats(os, "Closest hit", stats.closest);
+    printQueryStats(os, "Shadow", stats.shadow);
+    return os;
+}
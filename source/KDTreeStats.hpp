@@ -0,0 +1,38 @@
+#pragma once
+
+#include <ostream>
+
+/*
+ * Traversal counters are gathered only when compiled with KDTREE_STATS defined (make stats).
+ * Otherwise KDTREE_STAT expands to nothing and the counters cost nothing.
+ */
+#ifdef KDTREE_STATS
+#define KDTREE_STAT(statement) statement
+#else
+#define KDTREE_STAT(statement)
+#endif // KDTREE_STATS
+
+/**
+ * @brief Counters of a single kind of KDTree queries.
+ */
+struct KDTreeQueryStats {
+    unsigned long long queries = 0;
+    unsigned long long hits = 0;
+    /* Both interior and leaf nodes, counted once per ray also when traced in a packet. */
+    unsigned long long nodesVisited = 0;
+    unsigned long long leavesVisited = 0;
+    unsigned long long trianglesTested = 0;
+
+    KDTreeQueryStats &operator+=(const KDTreeQueryStats &rhs);
+};
+
+/**
+ * @brief Traversal counters split by query kind.
+ */
+struct KDTreeStats {
+    KDTreeQueryStats closest; // closest hit queries, including packets
+    KDTreeQueryStats shadow;  // any hit queries
+
+    KDTreeStats &operator+=(const KDTreeStats &rhs);
+    friend std::ostream &operator<<(std::ostream &os, const KDTreeStats &stats);
+};
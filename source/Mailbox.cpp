@@ -0,0 +1,31 @@
+#include "Mailbox.hpp"
+
+Mailbox::Mailbox() : rayId(0) { entries.fill({0, ~0u}); }
+
+void Mailbox::nextRay() {
+    if (++rayId == 0) {
+        // Ids wrapped around, forget entries of rays with the same ids.
+        entries.fill({0, ~0u});
+        rayId = 1;
+    }
+}
+
+bool Mailbox::markBlock(const TriangleBlock &block) {
+    bool fresh = false;
+    unsigned int cnt = 0;
+    // unused lanes are only at the end of the block
+    for (; cnt < TriangleBlock::width && block.trianIdx[cnt] != ~0u; cnt++)
+        fresh |= mark(block.trianIdx[cnt]);
+    (fresh ? testedCnt : skippedCnt) += cnt;
+    return fresh;
+}
+
+bool Mailbox::mark(unsigned int trianIdx) {
+    // Fibonacci hashing to the top 6 bits.
+    static_assert(size == 64);
+    Entry &e = entries[trianIdx * 2654435769u >> 26];
+    if (e.rayId == rayId && e.trianIdx == trianIdx)
+        return false;
+    e = {rayId, trianIdx};
+    return true;
+}
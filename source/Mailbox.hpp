@@ -0,0 +1,42 @@
+#pragma once
+
+#include "TriangleBlock.hpp"
+
+#include <array>
+
+/**
+ * @brief Small hashed cache of triangles already tested against the current ray, so that
+ * triangles referenced by several leaves are intersected once per ray.
+ * Entries are tagged with the ray id, so starting a new ray needs no clearing. Colliding
+ * triangles evict each other, which costs a repeated test but never a wrong result.
+ */
+class Mailbox {
+public:
+    static constexpr unsigned int size = 64;
+
+    /* Triangle tests done and skipped since the counters were last reset. */
+    unsigned long long testedCnt = 0;
+    unsigned long long skippedCnt = 0;
+
+    Mailbox();
+    void nextRay();
+    /**
+     * @brief Mark block's triangles as tested against the current ray and count them.
+     * @return false if all of them were tested before, so the block can be skipped.
+     */
+    bool markBlock(const TriangleBlock &block);
+
+private:
+    struct Entry {
+        unsigned int rayId;
+        unsigned int trianIdx;
+    };
+
+    std::array<Entry, size> entries;
+    unsigned int rayId;
+
+    /**
+     * @return false if trianIdx was already marked for the current ray.
+     */
+    bool mark(unsigned int trianIdx);
+};
@@ -0,0 +1,206 @@
+#include "QuantizedWideBVH.hpp"
+#include "WideBVHTraversal.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <utility>
+
+/* Rounding errors must not make rays miss boxes they graze, see BVH::intersectBounds. */
+static constexpr float boundsTolerance = 1.f + 3.f * std::numeric_limits<float>::epsilon();
+/* Exponents of cells' lengths are limited to normal floats. */
+static constexpr int minExponent = -126, maxExponent = 127;
+
+QuantizedWideBVH::QuantizedWideBVH(const std::vector<Triangle> &triangles,
+                                   const std::vector<Vertex> &vertices, BVHBuild build,
+                                   unsigned int buildThreads)
+    : triangles(triangles), vertices(vertices), rayRangeBias(0.f) {
+    if (triangles.empty())
+        return;
+    WideBVH wide(triangles, vertices, build, buildThreads);
+    rayRangeBias = wide.rayRangeBias;
+    floatNodesSize = wide.nodes.size() * sizeof(WideBVHNode);
+    nodes.reserve(wide.nodes.size());
+    leavesBlocks.reserve(wide.leavesBlocks.size());
+    nodes.emplace_back();
+    compress(wide, 0, 0);
+}
+
+float QuantizedWideBVHNode::cellLength(std::int8_t exponent) {
+    std::uint32_t bits = (std::uint32_t)(exponent + 127) << 23;
+    float length;
+    std::memcpy(&length, &bits, sizeof(length));
+    return length;
+}
+
+void QuantizedWideBVH::compress(const WideBVH &wide, unsigned int wideIdx, unsigned int nodeIdx) {
+    const WideBVHNode &wideNode = wide.nodes.at(wideIdx);
+    QuantizedWideBVHNode node;
+    std::vector<unsigned int> used;
+    for (unsigned int i = 0; i < QuantizedWideBVHNode::width; i++)
+        if (wideNode.bounds[0][0][i] <= wideNode.bounds[1][0][i])
+            used.push_back(i);
+
+    for (unsigned int axis = 0; axis < 3; axis++) {
+        float lower = std::numeric_limits<float>::infinity(),
+              upper = -std::numeric_limits<float>::infinity();
+        for (unsigned int i : used) {
+            lower = std::min(lower, wideNode.bounds[0][axis][i]);
+            upper = std::max(upper, wideNode.bounds[1][axis][i]);
+        }
+        node.origin[axis] = lower;
+        // The smallest power of 2 making 255 cells span the node, which has to hold for decoded
+        // bounds too.
+        int exponent = minExponent;
+        if (upper > lower) {
+            std::frexp((upper - lower) / 255.f, &exponent);
+            exponent = std::max(minExponent, exponent);
+        }
+        while (exponent < maxExponent &&
+               lower + 255.f * QuantizedWideBVHNode::cellLength(exponent) < upper)
+            exponent++;
+        node.exponents[axis] = exponent;
+    }
+
+    // Bounds are rounded outwards as they are decoded in traversal: origin + q * cell, which
+    // rounds once, as q * cell is exact.
+    node.interiorMask = 0;
+    node.firstChild = nodes.size();
+    node.firstBlock = leavesBlocks.size();
+    unsigned int interiorCnt = 0;
+    for (unsigned int i = 0; i < QuantizedWideBVHNode::width; i++) {
+        node.meta[i] = 0;
+        for (unsigned int axis = 0; axis < 3; axis++) {
+            node.bounds[0][axis][i] = 255;
+            node.bounds[1][axis][i] = 0;
+        }
+    }
+    for (unsigned int i : used) {
+        glm::vec3 exactExtent, quantizedExtent;
+        for (unsigned int axis = 0; axis < 3; axis++) {
+            float origin = node.origin[axis],
+                  cell = QuantizedWideBVHNode::cellLength(node.exponents[axis]);
+            float lower = wideNode.bounds[0][axis][i], upper = wideNode.bounds[1][axis][i];
+            float qLower = std::clamp(std::floor((lower - origin) / cell), 0.f, 255.f),
+                  qUpper = std::clamp(std::ceil((upper - origin) / cell), 0.f, 255.f);
+            while (qLower > 0.f && origin + qLower * cell > lower)
+                qLower--;
+            while (qUpper < 255.f && origin + qUpper * cell < upper)
+                qUpper++;
+            node.bounds[0][axis][i] = qLower;
+            node.bounds[1][axis][i] = qUpper;
+            exactExtent[axis] = upper - lower;
+            quantizedExtent[axis] = (qUpper - qLower) * cell;
+        }
+        auto surfaceArea = [](const glm::vec3 &e) {
+            return 2.f * (e.x * e.y + e.y * e.z + e.z * e.x);
+        };
+        exactChildrenSA += surfaceArea(exactExtent);
+        quantizedChildrenSA += surfaceArea(quantizedExtent);
+
+        if (wideNode.blocksCnts[i] > 0) {
+            node.meta[i] = (leavesBlocks.size() - node.firstBlock) << 3 | wideNode.blocksCnts[i];
+            leavesBlocks.insert(leavesBlocks.end(),
+                                wide.leavesBlocks.begin() + wideNode.children[i],
+                                wide.leavesBlocks.begin() + wideNode.children[i] +
+                                    wideNode.blocksCnts[i]);
+        } else {
+            node.interiorMask |= 1 << i;
+            node.meta[i] = interiorCnt++;
+        }
+    }
+    nodes.resize(nodes.size() + interiorCnt);
+    nodes.at(nodeIdx) = node;
+
+    for (unsigned int i : used)
+        if (node.interiorMask >> i & 1)
+            compress(wide, wideNode.children[i], node.firstChild + node.meta[i]);
+}
+
+int QuantizedWideBVHNode::intersectChildren(const glm::vec3 &o, const glm::vec3 &invD, float tMin,
+                                            float tMax, float *tMins) const {
+#ifdef SIMD_AVAILABLE
+    vfloat tNear = vset1(tMin), tFar = vset1(tMax);
+    for (unsigned int axis = 0; axis < 3; axis++) {
+        bool negative = invD[axis] < 0.f;
+        vfloat gridOrigin = vset1(origin[axis]), cell = vset1(cellLength(exponents[axis]));
+        vfloat oAxis = vset1(o[axis]), invDAxis = vset1(invD[axis]);
+        // Bounds the ray enters and leaves the children's slabs through.
+        vfloat entryBounds = vadd(gridOrigin, vmul(vloadBytes(bounds[negative][axis]), cell)),
+               exitBounds = vadd(gridOrigin, vmul(vloadBytes(bounds[!negative][axis]), cell));
+        vfloat t0 = vmul(vsub(entryBounds, oAxis), invDAxis),
+               t1 = vmul(vsub(exitBounds, oAxis), invDAxis);
+        tNear = vmax(t0, tNear);
+        tFar = vmin(vmul(t1, vset1(boundsTolerance)), tFar);
+    }
+    vstore(tMins, tNear);
+    return vmask(vle(tNear, tFar));
+#else
+    int mask = 0;
+    for (unsigned int i = 0; i < width; i++) {
+        float tNear = tMin, tFar = tMax;
+        for (unsigned int axis = 0; axis < 3; axis++) {
+            bool negative = invD[axis] < 0.f;
+            float gridOrigin = origin[axis], cell = cellLength(exponents[axis]);
+            float t0 = (gridOrigin + bounds[negative][axis][i] * cell - o[axis]) * invD[axis],
+                  t1 = (gridOrigin + bounds[!negative][axis][i] * cell - o[axis]) * invD[axis] *
+                       boundsTolerance;
+            tNear = t0 > tNear ? t0 : tNear;
+            tFar = t1 < tFar ? t1 : tFar;
+        }
+        tMins[i] = tNear;
+        mask |= (tNear <= tFar) << i;
+    }
+    return mask;
+#endif // SIMD_AVAILABLE
+}
+
+bool QuantizedWideBVHNode::isInterior(unsigned int i) const { return interiorMask >> i & 1; }
+
+unsigned int QuantizedWideBVHNode::interiorChild(unsigned int i) const {
+    return firstChild + meta[i];
+}
+
+unsigned int QuantizedWideBVHNode::leafFirstBlock(unsigned int i) const {
+    return firstBlock + (meta[i] >> 3);
+}
+
+unsigned int QuantizedWideBVHNode::leafBlocksCnt(unsigned int i) const { return meta[i] & 7; }
+
+bool QuantizedWideBVH::findNearestIntersection(const Ray &r, float &t, glm::vec3 &n,
+                                               unsigned int &trianIdx) const {
+    if (nodes.empty())
+        return false;
+    return WideBVHTraversal<QuantizedWideBVHNode>::findNearestIntersection(
+        nodes.data(), leavesBlocks.data(), triangles, vertices, rayRangeBias, r, t, n, trianIdx);
+}
+
+bool QuantizedWideBVH::isObstructed(const Ray &r) const {
+    if (nodes.empty())
+        return false;
+    return WideBVHTraversal<QuantizedWideBVHNode>::isObstructed(nodes.data(), leavesBlocks.data(),
+                                                                rayRangeBias, r);
+}
+
+void QuantizedWideBVH::printStats(std::ostream &os) const {
+    unsigned int childrenCnt = 0, leavesCnt = 0;
+    for (const QuantizedWideBVHNode &node : nodes)
+        for (unsigned int i = 0; i < QuantizedWideBVHNode::width; i++) {
+            bool used = node.bounds[0][0][i] <= node.bounds[1][0][i];
+            childrenCnt += used;
+            leavesCnt += used && !(node.interiorMask >> i & 1);
+        }
+    std::size_t nodesSize = nodes.capacity() * sizeof(QuantizedWideBVHNode);
+    os << "Nodes: " << nodes.size() << " of width " << QuantizedWideBVHNode::width
+       << ", children per node: "
+       << (double)childrenCnt / std::max<std::size_t>(1, nodes.size()) << ", leaves: " << leavesCnt
+       << '\n'
+       << "Memory: nodes " << nodesSize / 1024. << " KiB (" << sizeof(QuantizedWideBVHNode)
+       << " B each), leaves' blocks " << leavesBlocks.capacity() * sizeof(TriangleBlock) / 1024.
+       << " KiB\n"
+       << "Quantization: nodes take " << 100. * nodesSize / std::max<std::size_t>(1, floatNodesSize)
+       << "% of " << floatNodesSize / 1024.
+       << " KiB with float bounds, children's surface area grew by "
+       << 100. * (quantizedChildrenSA / std::max(exactChildrenSA, 1e-30) - 1.) << "%\n";
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "Accelerator.hpp"
+#include "BVH.hpp"
+#include "Mesh.hpp"
+#include "SIMD.hpp"
+#include "TriangleBlock.hpp"
+#include "WideBVH.hpp"
+
+#include <cstdint>
+#include <vector>
+
+/**
+ * Node of QuantizedWideBVH. Children's bounds are stored in cells of a grid spanning the node's
+ * bounds, 8 bits per bound, which makes an 8-wide node 80 bytes instead of WideBVHNode's 256.
+ */
+struct QuantizedWideBVHNode {
+    static constexpr unsigned int width = WideBVHNode::width;
+
+    /* Lower corner of node's bounds, the grid's origin. */
+    float origin[3];
+    /* Cells of the grid are 2^exponents[axis] long along axis. */
+    std::int8_t exponents[3];
+    /* Bit i is set for interior child i. */
+    std::uint8_t interiorMask;
+    /* Index of the first interior child. Interior children are consecutive. */
+    unsigned int firstChild;
+    /* Index of the first block of leaf children. Their blocks are consecutive. */
+    unsigned int firstBlock;
+    /* Index of the child relative to firstChild for interior children. For leaves, index of the
+     * first block relative to firstBlock times 8 plus number of blocks. 0 for unused children. */
+    std::uint8_t meta[width];
+    /* Lower (bounds[0]) and upper (bounds[1]) bounds along each axis of each child in grid cells,
+     * rounded outwards. Unused children have lower bounds of 255 and upper bounds of 0, so they
+     * are never hit. */
+    std::uint8_t bounds[2][3][width];
+
+    /**
+     * @return Length of grid's cells for the exponent.
+     */
+    static float cellLength(std::int8_t exponent);
+    /**
+     * @brief Test the ray against all children of the node, see WideBVHNode::intersectChildren.
+     */
+    int intersectChildren(const glm::vec3 &o, const glm::vec3 &invD, float tMin, float tMax,
+                          float *tMins) const;
+    bool isInterior(unsigned int i) const;
+    unsigned int interiorChild(unsigned int i) const;
+    unsigned int leafFirstBlock(unsigned int i) const;
+    unsigned int leafBlocksCnt(unsigned int i) const;
+};
+static_assert(QuantizedWideBVHNode::width != 8 || sizeof(QuantizedWideBVHNode) == 80);
+
+/**
+ * @brief WideBVH with QuantizedWideBVHNode nodes. Decoding bounds costs a few instructions per
+ * node, which pays off once the hierarchy no longer fits in cache and traversal waits on memory.
+ * Decoded bounds are never smaller than exact ones, so no hits are lost.
+ */
+class QuantizedWideBVH : public Accelerator {
+public:
+    /* Leaves' blocks counts have to fit in the lowest 3 bits of meta, their offsets in the rest. */
+    static constexpr unsigned int maxLeafBlocks = BVH::maxLeafCapacity / TriangleBlock::width;
+    static_assert(maxLeafBlocks < 8 && (QuantizedWideBVHNode::width - 1) * maxLeafBlocks < 32);
+
+    /**
+     * @param build How the collapsed BVH is built.
+     * @param buildThreads See BVH::BVH.
+     */
+    QuantizedWideBVH(const std::vector<Triangle> &triangles, const std::vector<Vertex> &vertices,
+                     BVHBuild build = BVHBuild::SAH, unsigned int buildThreads = 1);
+    bool findNearestIntersection(const Ray &r, float &t, glm::vec3 &n,
+                                 unsigned int &trianIdx) const override;
+    bool isObstructed(const Ray &r) const override;
+    /**
+     * @brief Print, besides the summary, how much memory quantization saved and how much it
+     * enlarged children's bounds.
+     */
+    void printStats(std::ostream &os) const override;
+
+private:
+    const std::vector<Triangle> &triangles;
+    const std::vector<Vertex> &vertices;
+    /* Empty if there are no triangles. */
+    std::vector<QuantizedWideBVHNode> nodes;
+    std::vector<TriangleBlock> leavesBlocks;
+    /* See KDTree::getRayRangeBias. */
+    float rayRangeBias;
+    /* Memory of WideBVH's nodes the hierarchy was made of. */
+    std::size_t floatNodesSize = 0;
+    /* Sums of surface areas of used children's exact and quantized bounds. */
+    double exactChildrenSA = 0., quantizedChildrenSA = 0.;
+
+    /**
+     * @brief Fill node nodeIdx from WideBVH's node wideIdx and its subtree.
+     */
+    void compress(const WideBVH &wide, unsigned int wideIdx, unsigned int nodeIdx);
+};
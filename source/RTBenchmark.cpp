@@ -0,0 +1,286 @@
+#include "RenderingTask.hpp"
+
+#include "BVH.hpp"
+#include "KDTreeAccelerator.hpp"
+#include "QuantizedWideBVH.hpp"
+#include "WideBVH.hpp"
+
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <utility>
+
+/**
+ * @brief Time closest-hit queries and print throughput.
+ */
+template <typename F>
+static void timeRays(const std::string &name, const std::vector<Ray> &rays, F query) {
+    unsigned int hits = 0;
+    auto begin = std::chrono::steady_clock::now();
+    for (const Ray &r : rays)
+        hits += query(r);
+    float time = std::chrono::duration_cast<std::chrono::microseconds>(
+                     std::chrono::steady_clock::now() - begin)
+                     .count() /
+                 1000000.f;
+    unsigned long long testedCnt, skippedCnt;
+    KDTree::takeMailboxStats(testedCnt, skippedCnt);
+    std::cout << name << ": " << rays.size() << " rays, " << hits << " hits, "
+              << rays.size() / time << " rays/s\n";
+    // Only k-d trees count triangle tests.
+    if (testedCnt > 0)
+        std::cout << "  " << (double)testedCnt / rays.size() << " triangle tests per ray, "
+                  << 100. * skippedCnt / std::max(1ull, testedCnt + skippedCnt)
+                  << "% skipped by mailboxing\n";
+    KDTREE_STAT(std::cout << KDTree::takeStats());
+}
+
+/* Rays are sampled from at most benchmarkRes x benchmarkRes evenly spread pixels. */
+static constexpr unsigned int benchmarkRes = 256;
+
+void RenderingTask::sampleRays(std::vector<Ray> &primaryRays, std::vector<Ray> &secondaryRays,
+                               std::vector<Ray> &shadowRays) const {
+    unsigned int stepX = std::max(1u, width / benchmarkRes),
+                 stepY = std::max(1u, height / benchmarkRes);
+    CosineSampler sampler;
+    for (unsigned int py = 0; py < height; py += stepY)
+        for (unsigned int px = 0; px < width; px += stepX) {
+            Ray r = getPrimaryRay(px, py);
+            primaryRays.push_back(r);
+            float t;
+            glm::vec3 n;
+            const Material *mat;
+            if (!findNearestIntersection(r, t, n, &mat))
+                continue;
+            auto [s, prob] = sampler();
+            glm::vec3 hit = r.o + t * r.d;
+            secondaryRays.emplace_back(hit, sampler.makeSampleRelativeToNormal(s, n));
+            if (lightIndices.size() != 0) {
+                // segment to the centroid of a light, cycling through all of them
+                const Triangle &light =
+                    triangles.at(lightIndices.at(shadowRays.size() % lightIndices.size()));
+                glm::vec3 lightPoint = (vertices.at(light.indices[0]).pos +
+                                        vertices.at(light.indices[1]).pos +
+                                        vertices.at(light.indices[2]).pos) /
+                                       3.f;
+                shadowRays.emplace_back(hit, glm::normalize(lightPoint - hit), 0.f,
+                                        glm::distance(hit, lightPoint));
+            }
+        }
+}
+
+void RenderingTask::benchmark() const {
+    std::vector<Ray> primaryRays, secondaryRays, shadowRays;
+    sampleRays(primaryRays, secondaryRays, shadowRays);
+
+    unsigned long long testedCnt, skippedCnt;
+    // discard counts from gathering the rays
+    KDTree::takeMailboxStats(testedCnt, skippedCnt);
+    KDTree::takeStats();
+    auto closestHit = [&](const Ray &r) {
+        float t;
+        glm::vec3 n;
+        const Material *mat;
+        return findNearestIntersection(r, t, n, &mat);
+    };
+    auto anyHit = [&](const Ray &r) {
+        bool obstructed;
+        isObstructed(&r, 1, &obstructed);
+        return obstructed;
+    };
+    auto timeQueries = [&](const std::string &suffix) {
+        timeRays("Primary rays" + suffix, primaryRays, closestHit);
+        timeRays("Secondary rays" + suffix, secondaryRays, closestHit);
+        timeRays("Shadow rays" + suffix, shadowRays, anyHit);
+    };
+    if (kdTree) {
+        for (KDTreeTraversal traversal : {KDTreeTraversal::Stack, KDTreeTraversal::Ropes}) {
+            kdTree->setTraversal(traversal);
+            timeQueries(traversal == KDTreeTraversal::Ropes ? " (ropes)" : " (stack)");
+        }
+        kdTree->setTraversal(KDTreeTraversal::Stack);
+        benchmarkKDTree(primaryRays, secondaryRays);
+    } else
+        timeQueries("");
+
+    // Build time against rendering speed of every acceleration structure.
+    std::vector<std::pair<std::string, std::function<std::unique_ptr<Accelerator>()>>> builders = {
+        {"SAH k-d tree",
+         [&]() {
+             return std::unique_ptr<Accelerator>(new KDTreeAccelerator(
+                 makeKDTree(KDTreeBuild::SAH, kdTreeParams), triangles, vertices));
+         }},
+        {"Binned SAH k-d tree",
+         [&]() {
+             return std::unique_ptr<Accelerator>(new KDTreeAccelerator(
+                 makeKDTree(KDTreeBuild::BinnedSAH, kdTreeParams), triangles, vertices));
+         }},
+        {"BVH",
+         [&]() {
+             return std::unique_ptr<Accelerator>(
+                 new BVH(triangles, vertices, BVHBuild::SAH, concThreads));
+         }},
+        {"LBVH",
+         [&]() {
+             return std::unique_ptr<Accelerator>(
+                 new BVH(triangles, vertices, BVHBuild::LBVH, concThreads));
+         }},
+        {"HLBVH",
+         [&]() {
+             return std::unique_ptr<Accelerator>(
+                 new BVH(triangles, vertices, BVHBuild::HLBVH, concThreads));
+         }},
+        {"SBVH",
+         [&]() {
+             return std::unique_ptr<Accelerator>(
+                 new BVH(triangles, vertices, BVHBuild::SBVH, concThreads));
+         }},
+        {"Wide BVH",
+         [&]() {
+             return std::unique_ptr<Accelerator>(
+                 new WideBVH(triangles, vertices, BVHBuild::SAH, concThreads));
+         }},
+        {"Quantized wide BVH",
+         [&]() {
+             return std::unique_ptr<Accelerator>(
+                 new QuantizedWideBVH(triangles, vertices, BVHBuild::SAH, concThreads));
+         }}};
+    for (const auto &[name, makeAccelerator] : builders) {
+        auto begin = std::chrono::steady_clock::now();
+        std::unique_ptr<Accelerator> acc = makeAccelerator();
+        float time = std::chrono::duration_cast<std::chrono::microseconds>(
+                         std::chrono::steady_clock::now() - begin)
+                         .count() /
+                     1000000.f;
+        std::cout << name << " build: " << time << " s\n";
+        auto accClosestHit = [&](const Ray &r) {
+            float t;
+            glm::vec3 n;
+            unsigned int trianIdx;
+            return acc->findNearestIntersection(r, t, n, trianIdx);
+        };
+        timeRays(name + " primary rays", primaryRays, accClosestHit);
+        timeRays(name + " secondary rays", secondaryRays, accClosestHit);
+        timeRays(name + " shadow rays", shadowRays,
+                 [&](const Ray &r) { return acc->isObstructed(r); });
+    }
+}
+
+void RenderingTask::benchmarkKDTree(const std::vector<Ray> &primaryRays,
+                                    const std::vector<Ray> &secondaryRays) const {
+    // The same primary rays in tiles of RayPacket::side x RayPacket::side, traced as packets
+    // starting at the root and at entry points found for tiles' frustums.
+    unsigned int stepX = std::max(1u, width / benchmarkRes),
+                 stepY = std::max(1u, height / benchmarkRes);
+    std::vector<RayPacket> packets;
+    std::vector<Frustum> frustums;
+    for (unsigned int ty = 0; ty < height; ty += stepY * RayPacket::side)
+        for (unsigned int tx = 0; tx < width; tx += stepX * RayPacket::side) {
+            RayPacket packet;
+            unsigned int lastX = tx, lastY = ty;
+            for (unsigned int py = ty; py < std::min(height, ty + stepY * RayPacket::side);
+                 py += stepY)
+                for (unsigned int px = tx; px < std::min(width, tx + stepX * RayPacket::side);
+                     px += stepX) {
+                    packet.push(getPrimaryRay(px, py));
+                    lastX = px;
+                    lastY = py;
+                }
+            packets.push_back(packet);
+            frustums.emplace_back(viewPoint, std::array<glm::vec3, 4>{
+                                                 getPrimaryRay(tx, ty).d,
+                                                 getPrimaryRay(lastX, ty).d,
+                                                 getPrimaryRay(lastX, lastY).d,
+                                                 getPrimaryRay(tx, lastY).d});
+        }
+    for (bool entryPoints : {false, true}) {
+        unsigned int packetsRaysCnt = 0, hitsCnt = 0;
+        auto begin = std::chrono::steady_clock::now();
+        for (unsigned int i = 0; i < packets.size(); i++) {
+            RayPacketHits hits;
+            if (entryPoints)
+                kdTree->findNearestIntersections(packets[i], triangles, vertices, hits,
+                                                 kdTree->findEntryPoint(frustums[i]));
+            else
+                kdTree->findNearestIntersections(packets[i], triangles, vertices, hits);
+            packetsRaysCnt += packets[i].cnt;
+            for (unsigned int j = 0; j < packets[i].cnt; j++)
+                hitsCnt += hits.hit[j];
+        }
+        float time = std::chrono::duration_cast<std::chrono::microseconds>(
+                         std::chrono::steady_clock::now() - begin)
+                         .count() /
+                     1000000.f;
+        std::cout << (entryPoints ? "Primary packets (entry points): " : "Primary packets (root): ")
+                  << packetsRaysCnt << " rays, " << hitsCnt << " hits, " << packetsRaysCnt / time
+                  << " rays/s\n";
+    }
+
+    std::cout << "Primary rays. ";
+    kdTree->benchmarkLeafKernels(primaryRays, std::cout);
+    std::cout << "Secondary rays. ";
+    kdTree->benchmarkLeafKernels(secondaryRays, std::cout);
+}
+
+void RenderingTask::autotune(KDTreeBuild build) {
+    std::vector<Ray> primaryRays, secondaryRays, shadowRays;
+    sampleRays(primaryRays, secondaryRays, shadowRays);
+
+    // A grid around the default parameters, together with the current ones. Only the ratio of
+    // intersection and traversal costs matters to SAH, so the latter stays fixed.
+    std::vector<KDTreeParams> candidates = {kdTreeParams};
+    unsigned int defaultMaxDepth = KDTreeParams::defaultMaxDepth(triangles.size());
+    for (unsigned int maxDepth : {defaultMaxDepth - 4, defaultMaxDepth, defaultMaxDepth + 4})
+        for (unsigned int maxLeafCapacity : {8u, 16u})
+            for (float emptyBonus : {0.f, .5f})
+                for (float isectCost : {20.f, 80.f}) {
+                    KDTreeParams params = {maxDepth, maxLeafCapacity, emptyBonus, 1.f, isectCost};
+                    if (!(params == kdTreeParams))
+                        candidates.push_back(params);
+                }
+
+    std::cout << "maxDepth maxLeafCapacity emptyBonus traversalCost isectCost: build time, rays "
+                 "time\n";
+    float bestTime = std::numeric_limits<float>::max();
+    std::unique_ptr<KDTree> bestTree;
+    for (const KDTreeParams &params : candidates) {
+        auto begin = std::chrono::steady_clock::now();
+        std::unique_ptr<KDTree> tree = makeKDTree(build, params);
+        auto built = std::chrono::steady_clock::now();
+        // The faster of two runs, to damp noise.
+        float time = std::numeric_limits<float>::max();
+        for (unsigned int run = 0; run < 2; run++) {
+            auto runBegin = std::chrono::steady_clock::now();
+            for (const std::vector<Ray> *rays : {&primaryRays, &secondaryRays})
+                for (const Ray &r : *rays) {
+                    float t;
+                    glm::vec3 n;
+                    unsigned int trianIdx;
+                    tree->findNearestIntersection(r, triangles, vertices, t, n, trianIdx);
+                }
+            for (const Ray &r : shadowRays)
+                tree->isObstructed(r);
+            time = std::min(time, std::chrono::duration_cast<std::chrono::microseconds>(
+                                      std::chrono::steady_clock::now() - runBegin)
+                                          .count() /
+                                      1000000.f);
+        }
+        std::cout << params.maxDepth << ' ' << params.maxLeafCapacity << ' ' << params.emptyBonus
+                  << ' ' << params.traversalCost << ' ' << params.isectCost << ": "
+                  << std::chrono::duration_cast<std::chrono::microseconds>(built - begin).count() /
+                         1000000.f
+                  << " s, " << time << " s\n";
+        if (time < bestTime) {
+            bestTime = time;
+            kdTreeParams = params;
+            bestTree = std::move(tree);
+        }
+    }
+    setKDTree(std::move(bestTree));
+
+    saveAccParams();
+    std::cout << "Best: " << kdTreeParams.maxDepth << ' ' << kdTreeParams.maxLeafCapacity << ' '
+              << kdTreeParams.emptyBonus << ' ' << kdTreeParams.traversalCost << ' '
+              << kdTreeParams.isectCost << ", saved to '" << accParamsPath << "'\n";
+}
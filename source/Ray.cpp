@@ -1,3 +1,5 @@
 #include "Ray.hpp"
 
+Ray::Ray() : Ray(glm::vec3(0), glm::vec3(0, 0, 1)) {}
+
 Ray::Ray(glm::vec3 o, glm::vec3 d, float tMin, float tMax) : o(o), d(d), tMin(tMin), tMax(tMax) {}
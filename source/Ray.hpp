@@ -9,5 +9,6 @@ public:
     float tMin;
     float tMax;
 
+    Ray();
     Ray(glm::vec3 o, glm::vec3 d, float tMin = 0.f, float tMax = std::numeric_limits<float>::max());
 };
@@ -0,0 +1,17 @@
+#include "RayPacket.hpp"
+
+#include <stdexcept>
+
+void RayPacket::push(const Ray &r) {
+    if (cnt == size)
+        throw std::length_error("Ray packet is full.");
+    for (unsigned int axis = 0; axis < 3; axis++) {
+        o[axis][cnt] = r.o[axis];
+        d[axis][cnt] = r.d[axis];
+    }
+    cnt++;
+}
+
+Ray RayPacket::getRay(unsigned int i) const {
+    return {{o[0][i], o[1][i], o[2][i]}, {d[0][i], d[1][i], d[2][i]}};
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "Ray.hpp"
+#include "SIMD.hpp"
+
+#include <glm/glm.hpp>
+
+/**
+ * @brief Rays of a square tile of pixels, traced through KDTree together.
+ * Stored in SoA layout, so that split plane tests are done for simdWidth rays at once.
+ */
+struct alignas(32) RayPacket {
+    static constexpr unsigned int side = 4; // packet covers side x side pixels
+    static constexpr unsigned int size = side * side;
+    static_assert(size % simdWidth == 0 && size <= 32);
+
+    float o[3][size];
+    float d[3][size];
+    unsigned int cnt = 0; // number of rays in use, the remaining lanes are ignored
+
+    void push(const Ray &r);
+    Ray getRay(unsigned int i) const;
+};
+
+/**
+ * @brief Closest hits of RayPacket's rays. Entries are valid only where hit is true.
+ */
+struct RayPacketHits {
+    bool hit[RayPacket::size];
+    float t[RayPacket::size];
+    glm::vec3 n[RayPacket::size];
+    unsigned int trianIdx[RayPacket::size];
+};
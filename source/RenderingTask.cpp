@@ -1,6 +1,11 @@
 #include "RenderingTask.hpp"
 
 #include "BRDFs.hpp"
+#include "BVH.hpp"
+#include "KDTreeAccelerator.hpp"
+#include "QuantizedWideBVH.hpp"
+#include "TwoLevelKDTree.hpp"
+#include "WideBVH.hpp"
 #include "ogl_interface/Axes.hpp"
 #include "utils.hpp"
 
@@ -27,6 +32,9 @@ using namespace std::chrono_literals;
 using namespace std::string_literals;
 namespace fs = std::filesystem;
 
+/* Number of rays (both closest-hit and shadow) cast by the current rendering thread. */
+static thread_local unsigned long long raysCnt;
+
 CacheAlignedCounter::CacheAlignedCounter(unsigned int counter) : counter(counter) {}
 
 RenderingTask::RenderingTask(std::string rtcPath, unsigned int nSamples, unsigned int concThreads)
@@ -49,6 +57,8 @@ RenderingTask::RenderingTask(std::string rtcPath, unsigned int nSamples, unsigne
     std::getline(configFile, origObjPath);
     std::string objPath = origObjPath;
     objPath = fs::path(rtcDir).append(objPath).string();
+    accCachePath = objPath + ".kdtree";
+    accParamsPath = objPath + ".kdparams";
 
     std::getline(configFile, outputPath);
 
@@ -146,6 +156,9 @@ RenderingTask::RenderingTask(std::string rtcPath, unsigned int nSamples, unsigne
         lightPowersCombined += power;
     }
 
+    kdTreeParams.maxDepth = KDTreeParams::defaultMaxDepth(triangles.size());
+    loadAccParams();
+
     std::cerr << triangles.size() << " triangles\n";
 }
 
@@ -154,10 +167,12 @@ void RenderingTask::render() const {
     std::vector<CacheAlignedCounter> progress(concThreads);
     std::vector<std::thread> ts;
 
-    /* Distribute pixels randomly between threads in order to make each thread
-     * work on average the same amount of time. */
+    /* Distribute tiles of RayPacket::side x RayPacket::side pixels randomly between threads in
+     * order to make each thread work on average the same amount of time. */
+    unsigned int tilesX = (width + RayPacket::side - 1) / RayPacket::side,
+                 tilesY = (height + RayPacket::side - 1) / RayPacket::side;
     std::unique_ptr<std::vector<unsigned int>> flatCoords(
-        new std::vector<unsigned int>(width * height, 0u));
+        new std::vector<unsigned int>(tilesX * tilesY, 0u));
     std::iota(flatCoords->begin(), flatCoords->end(), 0u);
 #ifdef DEBUG
     std::shuffle(flatCoords->begin(), flatCoords->end(), std::mt19937(42));
@@ -175,10 +190,12 @@ void RenderingTask::render() const {
     std::mutex endLock;
     auto begin = std::chrono::steady_clock::now();
     auto end = begin;
+    unsigned long long raysTotal = 0;
+    KDTreeStats kdTreeStats;
     for (unsigned int i = 0; i < concThreads; i++)
         ts.emplace_back(&RenderingTask::renderBatch, this, std::ref(pixels),
                         std::move(flatCoordsQueues.at(i)), std::ref(progress.at(i)), std::ref(end),
-                        std::ref(endLock));
+                        std::ref(raysTotal), std::ref(kdTreeStats), std::ref(endLock));
     std::cout << "Rendering using " << concThreads << " thread" << (concThreads == 1 ? "" : "s")
               << "...\n";
     std::this_thread::yield();
@@ -202,6 +219,8 @@ void RenderingTask::render() const {
     float tracingTime =
         std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count() / 1000000.f;
     std::cout << "Rendering time: " << tracingTime << " seconds.\n";
+    std::cout << "Rays cast: " << raysTotal << " (" << raysTotal / tracingTime << " rays/s).\n";
+    KDTREE_STAT(std::cout << kdTreeStats);
 
     // saving to file
     std::array<std::vector<half>, 3> imgData{std::vector<half>(width * height, 0),
@@ -254,11 +273,102 @@ void RenderingTask::updateRTCFile() {
     fout << this;
 }
 
-void RenderingTask::buildAccStructures() {
+void RenderingTask::buildAccStructures(KDTreeBuild build, bool useCache) {
     std::cerr << "Building acceleration structure...\n";
-    kdTree = std::unique_ptr<KDTree>(new KDTree(triangles, vertices,
-                                                std::round(8 + 1.3f * std::log2(triangles.size())),
-                                                16, 0.f, 1.f, 80.f));
+    auto begin = std::chrono::steady_clock::now();
+    kdTree = nullptr;
+    if (accType == AcceleratorType::TwoLevelKDTree)
+        accelerator.reset(new TwoLevelKDTree(meshes, triangles, vertices, kdTreeParams,
+                                             concThreads, build,
+                                             useCache ? accCachePath + "." : ""));
+    else if (accType == AcceleratorType::BVH)
+        accelerator.reset(new BVH(triangles, vertices, bvhBuild, concThreads));
+    else if (accType == AcceleratorType::WideBVH)
+        accelerator.reset(new WideBVH(triangles, vertices, bvhBuild, concThreads));
+    else if (accType == AcceleratorType::QuantizedWideBVH)
+        accelerator.reset(new QuantizedWideBVH(triangles, vertices, bvhBuild, concThreads));
+    else if (rayWeightedAcc && build == KDTreeBuild::SAH) {
+        setKDTree(makeKDTree(KDTreeBuild::BinnedSAH, kdTreeParams));
+        std::vector<glm::vec3> hits;
+        samplePilotHits(hits);
+        // Bounces of pilot rays are the same in every run, so the tree is found in the cache
+        // unless the scene, the view or the options changed.
+        setKDTree(makeKDTree(build, kdTreeParams, useCache ? accCachePath : "", hits));
+    } else
+        setKDTree(makeKDTree(build, kdTreeParams, useCache ? accCachePath : ""));
+    std::cerr << "Acceleration structure built in "
+              << std::chrono::duration_cast<std::chrono::microseconds>(
+                     std::chrono::steady_clock::now() - begin)
+                         .count() /
+                     1000000.f
+              << " seconds.\n";
+    if (printAccStats)
+        accelerator->printStats(std::cerr);
+}
+
+void RenderingTask::setKDTree(std::unique_ptr<KDTree> tree) {
+    kdTree = tree.get();
+    accelerator.reset(new KDTreeAccelerator(std::move(tree), triangles, vertices));
+}
+
+std::unique_ptr<KDTree> RenderingTask::makeKDTree(KDTreeBuild build, const KDTreeParams &params,
+                                                  const std::string &cachePath,
+                                                  const std::vector<glm::vec3> &rayHits) const {
+    return std::unique_ptr<KDTree>(new KDTree(triangles, vertices, params.maxDepth,
+                                              params.maxLeafCapacity, params.emptyBonus,
+                                              params.traversalCost, params.isectCost, concThreads,
+                                              build, cachePath, rayHits));
+}
+
+/* Pilot rays are traced from at most pilotRes x pilotRes evenly spread pixels. */
+static constexpr unsigned int pilotRes = 64;
+/* Seed of pilot rays' bounces, fixed so that trees fitted to them can be cached. */
+static constexpr unsigned int pilotSeed = 42;
+
+void RenderingTask::samplePilotHits(std::vector<glm::vec3> &hits) const {
+    unsigned int stepX = std::max(1u, width / pilotRes), stepY = std::max(1u, height / pilotRes);
+    CosineSampler sampler(pilotSeed);
+    for (unsigned int py = 0; py < height; py += stepY)
+        for (unsigned int px = 0; px < width; px += stepX) {
+            Ray r = getPrimaryRay(px, py);
+            float t;
+            glm::vec3 n;
+            const Material *mat;
+            if (!findNearestIntersection(r, t, n, &mat))
+                continue;
+            hits.push_back(r.o + t * r.d);
+            auto [s, prob] = sampler(n);
+            Ray bounce(hits.back(), s);
+            if (findNearestIntersection(bounce, t, n, &mat))
+                hits.push_back(bounce.o + t * bounce.d);
+        }
+}
+
+void RenderingTask::loadAccParams() {
+    std::ifstream paramsFile(accParamsPath);
+    if (!paramsFile.is_open())
+        return;
+    std::string line;
+    std::getline(paramsFile, line); // ignore comment line
+    std::getline(paramsFile, line);
+    KDTreeParams params;
+    if (sscanf(line.c_str(), "%u %u %f %f %f", &params.maxDepth, &params.maxLeafCapacity,
+               &params.emptyBonus, &params.traversalCost, &params.isectCost) < 5) {
+        std::cerr << "Could not parse '" + accParamsPath + "'. Using default parameters.\n";
+        return;
+    }
+    kdTreeParams = params;
+    std::cerr << "Using acceleration structure parameters from '" + accParamsPath + "'.\n";
+}
+
+void RenderingTask::saveAccParams() const {
+    std::ofstream fout(accParamsPath);
+    fout << "# maxDepth maxLeafCapacity emptyBonus traversalCost isectCost\n"
+         << kdTreeParams.maxDepth << ' ' << kdTreeParams.maxLeafCapacity << ' '
+         << kdTreeParams.emptyBonus << ' ' << kdTreeParams.traversalCost << ' '
+         << kdTreeParams.isectCost << '\n';
+    if (!fout)
+        std::cerr << "Could not write '" + accParamsPath + "'.\n";
 }
 
 Ray RenderingTask::getPrimaryRay(unsigned int px, unsigned int py) const {
@@ -276,7 +386,15 @@ RenderingTask::traceRay(const Ray &r, unsigned int maxDepth, std::mt19937 &randE
     const Material *mat;
     if (maxDepth == 0 || !findNearestIntersection(r, t, n, &mat))
         return {0, 0, 0};
+    return shadeHit(r, t, n, mat, maxDepth, randEng, brdf, sampler);
+}
 
+glm::vec3
+RenderingTask::shadeHit(const Ray &r, float t, const glm::vec3 &n, const Material *mat,
+                        unsigned int maxDepth, std::mt19937 &randEng,
+                        const std::function<glm::vec3(const glm::vec3 &, const glm::vec3 &,
+                                                      const glm::vec3 &, const Material &)> &brdf,
+                        HemisphereSampler &sampler) const {
     glm::vec3 color(0);
     if (mat->ke.r > 0.f || mat->ke.g > 0.f || mat->ke.b > 0.f) {
         if (maxDepth == recLvl)
@@ -288,29 +406,42 @@ RenderingTask::traceRay(const Ray &r, unsigned int maxDepth, std::mt19937 &randE
     static thread_local std::uniform_real_distribution<float> lightPowersDist(0.f,
                                                                               lightPowersCombined);
     static thread_local std::uniform_real_distribution<float> uniDist;
-    // sample random light if possible
+    // sample random lights if possible
     if (lightIndices.size() != 0) {
-        unsigned int lightIdx = getLightIdxFromRndVal(lightPowersDist(randEng));
-        const Triangle &light = triangles.at(lightIdx);
-        float alpha = uniDist(randEng);
-        float beta = 1.f - alpha;
-        const Vertex &lA = vertices.at(light.indices[0]);
-        const Vertex &lB = vertices.at(light.indices[1]);
-        const Vertex &lC = vertices.at(light.indices[2]);
-        glm::vec3 randLightPoint = lA.pos + alpha * (lB.pos - lA.pos) + beta * (lC.pos - lA.pos);
-        Ray lightRay(hit, glm::normalize(randLightPoint - hit));
-        glm::vec3 lightNorm =
-            glm::normalize(lA.norm + alpha * (lB.norm - lA.norm) + beta * (lC.norm - lA.norm));
-        float lightSqDist = glm::distance2(hit, randLightPoint);
-        float lightArea = light.area(vertices);
-        if (!isObstructed(lightRay, randLightPoint) && lightSqDist > minLightSqDist) {
-            const Material &lightMat = mats.at(trianglesToMatIndices.at(lightIdx));
+        unsigned int lightIdxs[lightSamplesCnt];
+        glm::vec3 lightNorms[lightSamplesCnt];
+        Ray lightRays[lightSamplesCnt];
+        bool obstructed[lightSamplesCnt];
+        for (unsigned int i = 0; i < lightSamplesCnt; i++) {
+            lightIdxs[i] = getLightIdxFromRndVal(lightPowersDist(randEng));
+            const Triangle &light = triangles.at(lightIdxs[i]);
+            float alpha = uniDist(randEng);
+            float beta = 1.f - alpha;
+            const Vertex &lA = vertices.at(light.indices[0]);
+            const Vertex &lB = vertices.at(light.indices[1]);
+            const Vertex &lC = vertices.at(light.indices[2]);
+            glm::vec3 randLightPoint =
+                lA.pos + alpha * (lB.pos - lA.pos) + beta * (lC.pos - lA.pos);
+            lightRays[i] = Ray(hit, glm::normalize(randLightPoint - hit), 0.f,
+                               glm::distance(hit, randLightPoint));
+            lightNorms[i] =
+                glm::normalize(lA.norm + alpha * (lB.norm - lA.norm) + beta * (lC.norm - lA.norm));
+        }
+        isObstructed(lightRays, lightSamplesCnt, obstructed);
+
+        for (unsigned int i = 0; i < lightSamplesCnt; i++) {
+            const Ray &lightRay = lightRays[i];
+            float lightSqDist = lightRay.tMax * lightRay.tMax;
+            if (obstructed[i] || lightSqDist <= minLightSqDist)
+                continue;
+            float lightArea = triangles.at(lightIdxs[i]).area(vertices);
+            const Material &lightMat = mats.at(trianglesToMatIndices.at(lightIdxs[i]));
             float lightProb = lightArea * (lightMat.ke.r + lightMat.ke.g + lightMat.ke.b) / 3.f /
                               lightPowersCombined;
             if (lightProb > .01f)
                 color += lightMat.ke * lightArea * brdf(lightRay.d, -r.d, n, *mat) *
-                         glm::abs(glm::dot(n, lightRay.d) * glm::dot(lightNorm, -lightRay.d)) /
-                         lightProb / lightSqDist;
+                         glm::abs(glm::dot(n, lightRay.d) * glm::dot(lightNorms[i], -lightRay.d)) /
+                         lightProb / lightSqDist / float(lightSamplesCnt);
         }
     }
 
@@ -333,22 +464,29 @@ RenderingTask::traceRay(const Ray &r, unsigned int maxDepth, std::mt19937 &randE
 bool RenderingTask::findNearestIntersection(const Ray &r, float &t, glm::vec3 &n,
                                             const Material **mat) const {
     unsigned int trianIdx;
-    bool ret = kdTree->findNearestIntersection(Ray(r), triangles, vertices, t, n, trianIdx);
+    raysCnt++;
+    bool ret = accelerator->findNearestIntersection(r, t, n, trianIdx);
     if (ret)
         *mat = &mats.at(trianglesToMatIndices.at(trianIdx));
     return ret;
 }
 
-bool RenderingTask::isObstructed(const Ray &r, const glm::vec3 &point) const {
-    glm::vec3 tVec = (point - r.o) / r.d;
-    float target = std::max({tVec.x, tVec.y, tVec.z});
-    return kdTree->isObstructed(Ray(r), target, triangles, vertices);
+void RenderingTask::findNearestIntersections(const RayPacket &packet, const Frustum &frustum,
+                                             RayPacketHits &hits) const {
+    raysCnt += packet.cnt;
+    accelerator->findNearestIntersections(packet, frustum, hits);
+}
+
+void RenderingTask::isObstructed(const Ray *rays, unsigned int cnt, bool *obstructed) const {
+    raysCnt += cnt;
+    accelerator->isObstructed(rays, cnt, obstructed);
 }
 
 void RenderingTask::renderBatch(std::vector<std::vector<glm::vec3>> &pixels,
                                 std::queue<unsigned int> &&flatCoordsQueue,
                                 CacheAlignedCounter &progress,
                                 std::chrono::steady_clock::time_point &ts,
+                                unsigned long long &raysTotal, KDTreeStats &kdTreeStats,
                                 std::mutex &tsLock) const {
 #ifdef DEBUG
     std::mt19937 randEng(42);
@@ -356,23 +494,52 @@ void RenderingTask::renderBatch(std::vector<std::vector<glm::vec3>> &pixels,
     std::mt19937 randEng((std::random_device())());
 #endif // DEBUG
     CosineSampler sampler;
+    raysCnt = 0;
 
+    unsigned int tilesX = (width + RayPacket::side - 1) / RayPacket::side;
     while (!flatCoordsQueue.empty()) {
         const auto p = flatCoordsQueue.front();
-        unsigned int px = p % width, py = p / width;
+        unsigned int tileX = p % tilesX * RayPacket::side, tileY = p / tilesX * RayPacket::side;
+        unsigned int tileEndX = std::min(width, tileX + RayPacket::side),
+                     tileEndY = std::min(height, tileY + RayPacket::side);
         flatCoordsQueue.pop();
-        glm::vec3 pixel(0);
-        for (unsigned int i = 0; i < nSamples; i++) {
-            pixel += traceRay(getPrimaryRay(px, py), recLvl, randEng, cookTorrance, sampler);
-        }
-        pixels.at(py).at(px) = pixel / float(nSamples);
-        progress.counter++;
+
+        /* Primary rays do not depend on the sample, so they are traced once per pixel as a
+         * packet and only shading is done for every sample. */
+        RayPacket packet;
+        for (unsigned int py = tileY; py < tileEndY; py++)
+            for (unsigned int px = tileX; px < tileEndX; px++)
+                packet.push(getPrimaryRay(px, py));
+        Frustum frustum(viewPoint, {getPrimaryRay(tileX, tileY).d,
+                                    getPrimaryRay(tileEndX - 1, tileY).d,
+                                    getPrimaryRay(tileEndX - 1, tileEndY - 1).d,
+                                    getPrimaryRay(tileX, tileEndY - 1).d});
+        RayPacketHits hits;
+        if (recLvl != 0)
+            findNearestIntersections(packet, frustum, hits);
+
+        unsigned int i = 0;
+        for (unsigned int py = tileY; py < tileEndY; py++)
+            for (unsigned int px = tileX; px < tileEndX; px++, i++) {
+                glm::vec3 pixel(0);
+                if (recLvl != 0 && hits.hit[i]) {
+                    const Material *mat = &mats.at(trianglesToMatIndices.at(hits.trianIdx[i]));
+                    Ray r = packet.getRay(i);
+                    for (unsigned int j = 0; j < nSamples; j++)
+                        pixel += shadeHit(r, hits.t[i], hits.n[i], mat, recLvl, randEng,
+                                          cookTorrance, sampler);
+                }
+                pixels.at(py).at(px) = pixel / float(nSamples);
+                progress.counter++;
+            }
     }
 
     auto end = std::chrono::steady_clock::now();
     tsLock.lock();
     if (end > ts)
         ts = end;
+    raysTotal += raysCnt;
+    KDTREE_STAT(kdTreeStats += KDTree::takeStats());
     tsLock.unlock();
 }
 
@@ -1,11 +1,14 @@
 #pragma once
 
+#include "Accelerator.hpp"
+#include "BVH.hpp"
 #include "HemisphereSampler.hpp"
 #include "KDTree.hpp"
 #include "Light.hpp"
 #include "Material.hpp"
 #include "Mesh.hpp"
 #include "Ray.hpp"
+#include "RayPacket.hpp"
 #include "ogl_interface/AGL3Window.hpp"
 #include "ogl_interface/Camera.hpp"
 
@@ -37,6 +40,8 @@ public:
 class RenderingTask {
 public:
     static constexpr float minLightSqDist = .01f;
+    /* Number of light samples for next event estimation at every hit. */
+    static constexpr unsigned int lightSamplesCnt = 1;
     std::string rtcPath;
     // given in rtc file
     std::string origObjPath;
@@ -51,6 +56,16 @@ public:
     glm::vec3 front;
     glm::vec3 right;
     bool renderPreview = false;
+    /* Print a summary of acceleration structure's structure after building it. */
+    bool printAccStats = false;
+    /* Acceleration structure built by buildAccStructures. Autotuning always uses a KDTree and
+     * benchmarks specific to it are skipped for the others. */
+    AcceleratorType accType = AcceleratorType::KDTree;
+    /* Fit SAH build of kdTree to the scene's rays, found by tracing a few of them through a quickly
+     * built tree first. Ignored for other acceleration structures and binned SAH build. */
+    bool rayWeightedAcc = false;
+    /* Build of BVH, WideBVH and QuantizedWideBVH. */
+    BVHBuild bvhBuild = BVHBuild::SAH;
 
     RenderingTask(std::string rtcPath, unsigned int nSamples,
                   unsigned int concThreads = std::thread::hardware_concurrency());
@@ -58,7 +73,22 @@ public:
     void preview();
     friend std::ostream &operator<<(std::ostream &os, const RenderingTask *rt);
     void updateRTCFile();
-    void buildAccStructures();
+    /**
+     * @param useCache Load the tree from a file next to the OBJ file if an earlier run saved it
+     * there for the same scene and build parameters, and save it otherwise.
+     */
+    void buildAccStructures(KDTreeBuild build = KDTreeBuild::SAH, bool useCache = true);
+    /**
+     * @brief Measure acceleration structure performance on rays sampled from the scene.
+     * Implemented in RTBenchmark.cpp.
+     */
+    void benchmark() const;
+    /**
+     * @brief Build trees over a grid of parameters, time rays sampled from the scene against each
+     * and save the fastest parameters next to the OBJ file, where later runs read them from.
+     * Implemented in RTBenchmark.cpp.
+     */
+    void autotune(KDTreeBuild build = KDTreeBuild::SAH);
 
 private:
     class RTWindow : public AGLWindow {
@@ -81,7 +111,15 @@ private:
      * This cannot be kept in Triangle struct, because Triangle structs are passed to element
      * buffer in OpenGL. */
     std::vector<unsigned int> trianglesToMatIndices;
-    std::unique_ptr<KDTree> kdTree;
+    std::unique_ptr<Accelerator> accelerator;
+    /* Tree of accelerator if it is a KDTreeAccelerator, nullptr otherwise. */
+    KDTree *kdTree = nullptr;
+    /* File kdTree is cached in between runs. Trees of meshes are cached in files named by it, a dot
+     * and the hash of mesh's geometry in 16 hex digits, see TwoLevelKDTree::TwoLevelKDTree. */
+    std::string accCachePath;
+    KDTreeParams kdTreeParams;
+    /* File with kdTreeParams found by autotune. */
+    std::string accParamsPath;
     /* lightIndices stores indices to triangles vector that have non-zero emission.
      * lightIndices and lightPowersCdf are of equal sizes. */
     std::vector<unsigned int> lightIndices;
@@ -90,6 +128,38 @@ private:
     unsigned int concThreads;
     unsigned int nSamples;
 
+    /**
+     * @param cachePath See KDTree constructor.
+     */
+    std::unique_ptr<KDTree> makeKDTree(KDTreeBuild build, const KDTreeParams &params,
+                                       const std::string &cachePath = "",
+                                       const std::vector<glm::vec3> &rayHits = {}) const;
+    /**
+     * @brief Make the tree accelerator.
+     */
+    void setKDTree(std::unique_ptr<KDTree> tree);
+    /**
+     * @brief Find where primary rays of pilotRes x pilotRes evenly spread pixels and a cosine
+     * distributed bounce off each of their hits hit the scene.
+     */
+    void samplePilotHits(std::vector<glm::vec3> &hits) const;
+    /**
+     * @brief Read kdTreeParams from accParamsPath if the file exists.
+     */
+    void loadAccParams();
+    void saveAccParams() const;
+    /**
+     * @brief Gather rays for measuring acceleration structure performance: primary rays of evenly
+     * spread pixels, a cosine distributed bounce off every primary hit and a shadow ray from the
+     * hit to a light.
+     */
+    void sampleRays(std::vector<Ray> &primaryRays, std::vector<Ray> &secondaryRays,
+                    std::vector<Ray> &shadowRays) const;
+    /**
+     * @brief Measure speed of kdTree's packet traversal and leaf kernels.
+     */
+    void benchmarkKDTree(const std::vector<Ray> &primaryRays,
+                         const std::vector<Ray> &secondaryRays) const;
     Ray getPrimaryRay(unsigned int px, unsigned int py) const;
     /**
      * @param brdf Takes incoming vector, outgoing vector, surface normal vector and material as
@@ -99,11 +169,31 @@ private:
                        const std::function<glm::vec3(const glm::vec3 &, const glm::vec3 &,
                                                      const glm::vec3 &, const Material &)> &brdf,
                        HemisphereSampler &sampler) const;
+    /**
+     * @brief Compute radiance leaving hit point towards ray's origin.
+     * @param t Distance along the ray to the hit point.
+     * @param n Surface normal at the hit point.
+     */
+    glm::vec3 shadeHit(const Ray &r, float t, const glm::vec3 &n, const Material *mat,
+                       unsigned int maxDepth, std::mt19937 &randEng,
+                       const std::function<glm::vec3(const glm::vec3 &, const glm::vec3 &,
+                                                     const glm::vec3 &, const Material &)> &brdf,
+                       HemisphereSampler &sampler) const;
     bool findNearestIntersection(const Ray &r, float &t, glm::vec3 &n, const Material **mat) const;
-    bool isObstructed(const Ray &r, const glm::vec3 &point) const;
+    /**
+     * @param frustum Frustum containing all packet's rays.
+     */
+    void findNearestIntersections(const RayPacket &packet, const Frustum &frustum,
+                                  RayPacketHits &hits) const;
+    /**
+     * @param rays Segments to test, each of length tMax.
+     * @param obstructed Array of cnt elements. i-th is set to the result for rays[i].
+     */
+    void isObstructed(const Ray *rays, unsigned int cnt, bool *obstructed) const;
     void renderBatch(std::vector<std::vector<glm::vec3>> &pixels,
                      std::queue<unsigned int> &&flatCoordsQueue, CacheAlignedCounter &progress,
-                     std::chrono::steady_clock::time_point &ts, std::mutex &tsLock) const;
+                     std::chrono::steady_clock::time_point &ts, unsigned long long &raysTotal,
+                     KDTreeStats &kdTreeStats, std::mutex &tsLock) const;
     void recomputeCameraParams();
     unsigned int getLightIdxFromRndVal(const float rnd) const;
     unsigned int getLightIdxFromRndVal(const float rnd, const unsigned int begin,
@@ -0,0 +1,83 @@
+/*
+ * Thin wrappers around SSE2/AVX intrinsics, so that vectorised kernels are written once for both
+ * vector widths. Defining NO_SIMD (or building for a target without SSE2) leaves only simdWidth
+ * defined and kernels are expected to fall back to scalar code.
+ */
+
+#pragma once
+
+#if !defined(NO_SIMD) && (defined(__AVX__) || defined(__SSE2__))
+#include <immintrin.h>
+#define SIMD_AVAILABLE
+#endif
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(SIMD_AVAILABLE) && defined(__AVX__)
+constexpr unsigned int simdWidth = 8;
+#else
+constexpr unsigned int simdWidth = 4;
+#endif
+
+#ifdef SIMD_AVAILABLE
+#ifdef __AVX__
+typedef __m256 vfloat;
+inline vfloat vset1(float a) { return _mm256_set1_ps(a); }
+inline vfloat vload(const float *p) { return _mm256_load_ps(p); }
+/* Load 8 unsigned bytes as floats. */
+inline vfloat vloadBytes(const std::uint8_t *p) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i words = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)p), zero);
+    __m256i ints = _mm256_insertf128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi16(words, zero)),
+                                           _mm_unpackhi_epi16(words, zero), 1);
+    return _mm256_cvtepi32_ps(ints);
+}
+inline void vstore(float *p, vfloat a) { _mm256_store_ps(p, a); }
+inline vfloat vadd(vfloat a, vfloat b) { return _mm256_add_ps(a, b); }
+inline vfloat vsub(vfloat a, vfloat b) { return _mm256_sub_ps(a, b); }
+inline vfloat vmul(vfloat a, vfloat b) { return _mm256_mul_ps(a, b); }
+inline vfloat vdiv(vfloat a, vfloat b) { return _mm256_div_ps(a, b); }
+inline vfloat vmin(vfloat a, vfloat b) { return _mm256_min_ps(a, b); }
+inline vfloat vmax(vfloat a, vfloat b) { return _mm256_max_ps(a, b); }
+inline vfloat vand(vfloat a, vfloat b) { return _mm256_and_ps(a, b); }
+inline vfloat vor(vfloat a, vfloat b) { return _mm256_or_ps(a, b); }
+inline vfloat vandnot(vfloat a, vfloat b) { return _mm256_andnot_ps(a, b); } // ~a & b
+inline vfloat vlt(vfloat a, vfloat b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+inline vfloat vle(vfloat a, vfloat b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+inline vfloat vgt(vfloat a, vfloat b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+inline vfloat veq(vfloat a, vfloat b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+inline vfloat vblend(vfloat mask, vfloat a, vfloat b) { return _mm256_blendv_ps(b, a, mask); }
+inline int vmask(vfloat a) { return _mm256_movemask_ps(a); }
+#else
+typedef __m128 vfloat;
+inline vfloat vset1(float a) { return _mm_set1_ps(a); }
+inline vfloat vload(const float *p) { return _mm_load_ps(p); }
+/* Load 4 unsigned bytes as floats. */
+inline vfloat vloadBytes(const std::uint8_t *p) {
+    int bytes;
+    std::memcpy(&bytes, p, sizeof(bytes));
+    __m128i zero = _mm_setzero_si128();
+    return _mm_cvtepi32_ps(
+        _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero), zero));
+}
+inline void vstore(float *p, vfloat a) { _mm_store_ps(p, a); }
+inline vfloat vadd(vfloat a, vfloat b) { return _mm_add_ps(a, b); }
+inline vfloat vsub(vfloat a, vfloat b) { return _mm_sub_ps(a, b); }
+inline vfloat vmul(vfloat a, vfloat b) { return _mm_mul_ps(a, b); }
+inline vfloat vdiv(vfloat a, vfloat b) { return _mm_div_ps(a, b); }
+inline vfloat vmin(vfloat a, vfloat b) { return _mm_min_ps(a, b); }
+inline vfloat vmax(vfloat a, vfloat b) { return _mm_max_ps(a, b); }
+inline vfloat vand(vfloat a, vfloat b) { return _mm_and_ps(a, b); }
+inline vfloat vor(vfloat a, vfloat b) { return _mm_or_ps(a, b); }
+inline vfloat vandnot(vfloat a, vfloat b) { return _mm_andnot_ps(a, b); } // ~a & b
+inline vfloat vlt(vfloat a, vfloat b) { return _mm_cmplt_ps(a, b); }
+inline vfloat vle(vfloat a, vfloat b) { return _mm_cmple_ps(a, b); }
+inline vfloat vgt(vfloat a, vfloat b) { return _mm_cmpgt_ps(a, b); }
+inline vfloat veq(vfloat a, vfloat b) { return _mm_cmpeq_ps(a, b); }
+inline vfloat vblend(vfloat mask, vfloat a, vfloat b) {
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+inline int vmask(vfloat a) { return _mm_movemask_ps(a); }
+#endif // __AVX__
+#endif // SIMD_AVAILABLE
@@ -0,0 +1,167 @@
+#include "TriangleBlock.hpp"
+
+#include <limits>
+
+#ifdef SIMD_AVAILABLE
+namespace {
+/**
+ * @brief Test all lanes of the block at once.
+ * Operations are ordered as in glm::intersectRayTriangle, so lanes give the same results as the
+ * scalar test.
+ * @return Mask of lanes hit with t in (tMin, tMax).
+ */
+inline int intersectBlock(const TriangleBlock &b, const glm::vec3 &o, const glm::vec3 &d,
+                          float tMin, float tMax, vfloat &t, vfloat &u, vfloat &v) {
+    const vfloat ox = vset1(o.x), oy = vset1(o.y), oz = vset1(o.z);
+    const vfloat dx = vset1(d.x), dy = vset1(d.y), dz = vset1(d.z);
+    const vfloat e1x = vload(b.e1[0]), e1y = vload(b.e1[1]), e1z = vload(b.e1[2]);
+    const vfloat e2x = vload(b.e2[0]), e2y = vload(b.e2[1]), e2z = vload(b.e2[2]);
+    const vfloat eps = vset1(std::numeric_limits<float>::epsilon()), zero = vset1(0.f);
+
+    // p = cross(d, e2)
+    vfloat px = vsub(vmul(dy, e2z), vmul(e2y, dz));
+    vfloat py = vsub(vmul(dz, e2x), vmul(e2z, dx));
+    vfloat pz = vsub(vmul(dx, e2y), vmul(e2x, dy));
+    vfloat det = vadd(vadd(vmul(e1x, px), vmul(e1y, py)), vmul(e1z, pz));
+
+    vfloat sx = vsub(ox, vload(b.v0[0])), sy = vsub(oy, vload(b.v0[1])),
+           sz = vsub(oz, vload(b.v0[2]));
+    u = vadd(vadd(vmul(sx, px), vmul(sy, py)), vmul(sz, pz));
+    // q = cross(s, e1)
+    vfloat qx = vsub(vmul(sy, e1z), vmul(e1y, sz));
+    vfloat qy = vsub(vmul(sz, e1x), vmul(e1z, sx));
+    vfloat qz = vsub(vmul(sx, e1y), vmul(e1x, sy));
+    v = vadd(vadd(vmul(dx, qx), vmul(dy, qy)), vmul(dz, qz));
+    vfloat uv = vadd(u, v);
+
+    // Rejections are negated comparisons, so NaNs pass them exactly as in the scalar test.
+    vfloat posOk = vgt(det, eps);
+    posOk = vandnot(vor(vlt(u, zero), vgt(u, det)), posOk);
+    posOk = vandnot(vor(vlt(v, zero), vgt(uv, det)), posOk);
+    vfloat negOk = vlt(det, vsub(zero, eps));
+    negOk = vandnot(vor(vgt(u, zero), vlt(u, det)), negOk);
+    negOk = vandnot(vor(vgt(v, zero), vlt(uv, det)), negOk);
+
+    vfloat invDet = vdiv(vset1(1.f), det);
+    t = vmul(vadd(vadd(vmul(e2x, qx), vmul(e2y, qy)), vmul(e2z, qz)), invDet);
+    u = vmul(u, invDet);
+    v = vmul(v, invDet);
+
+    vfloat valid = vand(vor(posOk, negOk), vand(vgt(t, vset1(tMin)), vlt(t, vset1(tMax))));
+    return vmask(valid);
+}
+} // namespace
+#endif // SIMD_AVAILABLE
+
+TriangleBlock::TriangleBlock() {
+    for (unsigned int lane = 0; lane < width; lane++) {
+        for (unsigned int axis = 0; axis < 3; axis++)
+            v0[axis][lane] = e1[axis][lane] = e2[axis][lane] = 0.f;
+        trianIdx[lane] = ~0u;
+    }
+}
+
+void TriangleBlock::setLane(unsigned int lane, const Triangle &t, unsigned int trianIdx,
+                            const std::vector<Vertex> &vertices) {
+    const glm::vec3 &a = vertices.at(t.indices[0]).pos;
+    const glm::vec3 &b = vertices.at(t.indices[1]).pos;
+    const glm::vec3 &c = vertices.at(t.indices[2]).pos;
+    for (unsigned int axis = 0; axis < 3; axis++) {
+        v0[axis][lane] = a[axis];
+        e1[axis][lane] = b[axis] - a[axis];
+        e2[axis][lane] = c[axis] - a[axis];
+    }
+    this->trianIdx[lane] = trianIdx;
+}
+
+int TriangleBlock::intersectNearest(const glm::vec3 &o, const glm::vec3 &d, float tMin,
+                                    float &tMax, glm::vec2 &baryPos) const {
+#ifdef SIMD_AVAILABLE
+    vfloat t, u, v;
+    int mask = intersectBlock(*this, o, d, tMin, tMax, t, u, v);
+    if (mask == 0)
+        return -1;
+
+    alignas(32) float ts[width], us[width], vs[width];
+    vstore(ts, t);
+    int nearest = -1;
+    for (unsigned int lane = 0; mask != 0; lane++, mask >>= 1)
+        if ((mask & 1) && ts[lane] < tMax) {
+            tMax = ts[lane];
+            nearest = lane;
+        }
+    vstore(us, u);
+    vstore(vs, v);
+    baryPos = {us[nearest], vs[nearest]};
+    return nearest;
+#else
+    return intersectNearestScalar(o, d, tMin, tMax, baryPos);
+#endif // SIMD_AVAILABLE
+}
+
+bool TriangleBlock::intersectAny(const glm::vec3 &o, const glm::vec3 &d, float tMin,
+                                 float tMax) const {
+#ifdef SIMD_AVAILABLE
+    vfloat t, u, v;
+    return intersectBlock(*this, o, d, tMin, tMax, t, u, v) != 0;
+#else
+    return intersectAnyScalar(o, d, tMin, tMax);
+#endif // SIMD_AVAILABLE
+}
+
+int TriangleBlock::intersectNearestScalar(const glm::vec3 &o, const glm::vec3 &d, float tMin,
+                                          float &tMax, glm::vec2 &baryPos) const {
+    int nearest = -1;
+    glm::vec2 laneBaryPos;
+    float t;
+    for (unsigned int lane = 0; lane < width; lane++)
+        if (intersectLane(lane, o, d, laneBaryPos, t) && tMin < t && t < tMax) {
+            tMax = t;
+            baryPos = laneBaryPos;
+            nearest = lane;
+        }
+    return nearest;
+}
+
+bool TriangleBlock::intersectAnyScalar(const glm::vec3 &o, const glm::vec3 &d, float tMin,
+                                       float tMax) const {
+    glm::vec2 baryPos;
+    float t;
+    for (unsigned int lane = 0; lane < width; lane++)
+        if (intersectLane(lane, o, d, baryPos, t) && tMin < t && t < tMax)
+            return true;
+    return false;
+}
+
+bool TriangleBlock::intersectLane(unsigned int lane, const glm::vec3 &o, const glm::vec3 &d,
+                                  glm::vec2 &baryPos, float &t) const {
+    constexpr float eps = std::numeric_limits<float>::epsilon();
+    glm::vec3 e1(this->e1[0][lane], this->e1[1][lane], this->e1[2][lane]);
+    glm::vec3 e2(this->e2[0][lane], this->e2[1][lane], this->e2[2][lane]);
+    glm::vec3 p = glm::cross(d, e2);
+    float det = glm::dot(e1, p);
+    glm::vec3 dist = o - glm::vec3(v0[0][lane], v0[1][lane], v0[2][lane]), q;
+    if (det > eps) {
+        baryPos.x = glm::dot(dist, p);
+        if (baryPos.x < 0.f || baryPos.x > det)
+            return false;
+        q = glm::cross(dist, e1);
+        baryPos.y = glm::dot(d, q);
+        if (baryPos.y < 0.f || baryPos.x + baryPos.y > det)
+            return false;
+    } else if (det < -eps) {
+        baryPos.x = glm::dot(dist, p);
+        if (baryPos.x > 0.f || baryPos.x < det)
+            return false;
+        q = glm::cross(dist, e1);
+        baryPos.y = glm::dot(d, q);
+        if (baryPos.y > 0.f || baryPos.x + baryPos.y < det)
+            return false;
+    } else
+        return false; // ray is parallel to the triangle's plane
+
+    float invDet = 1.f / det;
+    t = glm::dot(e2, q) * invDet;
+    baryPos *= invDet;
+    return true;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "Mesh.hpp"
+#include "SIMD.hpp"
+
+#include <glm/glm.hpp>
+
+#include <vector>
+
+/**
+ * @brief Intersection data of up to TriangleBlock::width triangles in SoA layout, so that a
+ * single SIMD kernel tests all of them at once.
+ * Unused lanes hold degenerate triangles that are never hit.
+ */
+struct alignas(32) TriangleBlock {
+    static constexpr unsigned int width = simdWidth;
+
+    float v0[3][width]; // first vertex
+    float e1[3][width]; // second vertex minus first vertex
+    float e2[3][width]; // third vertex minus first vertex
+    /* Indices to triangles vector the lanes were made from. ~0u in unused lanes. */
+    unsigned int trianIdx[width];
+
+    TriangleBlock();
+    void setLane(unsigned int lane, const Triangle &t, unsigned int trianIdx,
+                 const std::vector<Vertex> &vertices);
+    /**
+     * @brief Find nearest hit with t in (tMin, tMax). Ties are resolved in favour of the lower
+     * lane, which gives the same results as testing lanes one by one.
+     * @param tMax Updated with distance to the found hit.
+     * @param baryPos Barycentric coordinates of the hit with respect to second and third vertex.
+     * @return Lane of the nearest hit or -1 if none was found.
+     */
+    int intersectNearest(const glm::vec3 &o, const glm::vec3 &d, float tMin, float &tMax,
+                         glm::vec2 &baryPos) const;
+    /**
+     * @return true if any triangle is hit with t in (tMin, tMax).
+     */
+    bool intersectAny(const glm::vec3 &o, const glm::vec3 &d, float tMin, float tMax) const;
+    /* Portable lane-by-lane versions of the above. */
+    int intersectNearestScalar(const glm::vec3 &o, const glm::vec3 &d, float tMin, float &tMax,
+                               glm::vec2 &baryPos) const;
+    bool intersectAnyScalar(const glm::vec3 &o, const glm::vec3 &d, float tMin, float tMax) const;
+
+private:
+    /**
+     * @brief Möller–Trumbore test of a single lane giving the same results as
+     * glm::intersectRayTriangle.
+     */
+    bool intersectLane(unsigned int lane, const glm::vec3 &o, const glm::vec3 &d,
+                       glm::vec2 &baryPos, float &t) const;
+};
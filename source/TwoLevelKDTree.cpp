@@ -0,0 +1,223 @@
+#include "TwoLevelKDTree.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <numeric>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+
+TwoLevelKDTree::TwoLevelKDTree(const std::vector<Mesh> &meshes,
+                               const std::vector<Triangle> &triangles,
+                               const std::vector<Vertex> &vertices, const KDTreeParams &params,
+                               unsigned int buildThreads, KDTreeBuild build,
+                               const std::string &cachePathPrefix)
+    : vertices(vertices) {
+    for (unsigned int i = 0; i < meshes.size(); i++) {
+        const Mesh &mesh = meshes.at(i);
+        if (mesh.trianglesCnt == 0)
+            continue;
+        meshTrees.push_back({mesh.firstTriangleIdx,
+                             std::vector<Triangle>(triangles.begin() + mesh.firstTriangleIdx,
+                                                   triangles.begin() + mesh.firstTriangleIdx +
+                                                       mesh.trianglesCnt),
+                             nullptr});
+    }
+
+    // Meshes of the same geometry share a tree, which is built and cached once. Hashes are
+    // confirmed by comparing positions, and the rare meshes colliding with another one's hash
+    // get trees that are not cached.
+    std::vector<unsigned int> treesMeshes;
+    std::vector<std::string> cachePaths;
+    std::unordered_map<std::uint64_t, unsigned int> hashesTrees;
+    auto samePositions = [&](const MeshTree &m1, const MeshTree &m2) {
+        if (m1.triangles.size() != m2.triangles.size())
+            return false;
+        for (unsigned int i = 0; i < m1.triangles.size(); i++)
+            for (unsigned int v = 0; v < 3; v++)
+                if (vertices.at(m1.triangles.at(i).indices[v]).pos !=
+                    vertices.at(m2.triangles.at(i).indices[v]).pos)
+                    return false;
+        return true;
+    };
+    std::vector<unsigned int> meshesTrees(meshTrees.size());
+    for (unsigned int i = 0; i < meshTrees.size(); i++) {
+        std::uint64_t hash = KDTree::hashGeometry(meshTrees.at(i).triangles, vertices);
+        auto [it, inserted] = hashesTrees.try_emplace(hash, treesMeshes.size());
+        if (!inserted && samePositions(meshTrees.at(treesMeshes.at(it->second)), meshTrees.at(i))) {
+            meshesTrees.at(i) = it->second;
+            continue;
+        }
+        meshesTrees.at(i) = treesMeshes.size();
+        treesMeshes.push_back(i);
+        std::ostringstream path;
+        if (inserted && !cachePathPrefix.empty())
+            path << cachePathPrefix << std::hex << std::setw(16) << std::setfill('0') << hash;
+        cachePaths.push_back(path.str());
+    }
+    trees.resize(treesMeshes.size());
+
+    auto buildTree = [&](unsigned int i, unsigned int threads) {
+        const MeshTree &meshTree = meshTrees.at(treesMeshes.at(i));
+        trees.at(i).reset(new KDTree(meshTree.triangles, vertices,
+                                     KDTreeParams::defaultMaxDepth(meshTree.triangles.size()),
+                                     params.maxLeafCapacity, params.emptyBonus,
+                                     params.traversalCost, params.isectCost, threads, build,
+                                     cachePaths.at(i), {}, false));
+    };
+    // Large meshes are built one by one with all threads, the others by a thread each.
+    std::vector<unsigned int> smallTrees;
+    for (unsigned int i = 0; i < trees.size(); i++)
+        if (meshTrees.at(treesMeshes.at(i)).triangles.size() >= KDTree::minParallelBuildCnt)
+            buildTree(i, buildThreads);
+        else
+            smallTrees.push_back(i);
+    std::atomic<unsigned int> nextSmallTree = 0;
+    auto buildSmallTrees = [&]() {
+        for (unsigned int i = nextSmallTree++; i < smallTrees.size(); i = nextSmallTree++)
+            buildTree(smallTrees.at(i), 1);
+    };
+    std::vector<std::thread> threads;
+    for (unsigned int i = 1; i < std::min<std::size_t>(buildThreads, smallTrees.size()); i++)
+        threads.emplace_back(buildSmallTrees);
+    buildSmallTrees();
+    for (std::thread &t : threads)
+        t.join();
+    for (unsigned int i = 0; i < meshTrees.size(); i++)
+        meshTrees.at(i).tree = trees.at(meshesTrees.at(i)).get();
+
+    if (meshTrees.empty())
+        return;
+    std::vector<unsigned int> meshesIndices(meshTrees.size());
+    std::iota(meshesIndices.begin(), meshesIndices.end(), 0);
+    nodes.reserve(2 * meshTrees.size() - 1);
+    buildTopLevel(meshesIndices, 0, meshesIndices.size(), 0);
+    // Rays are offset by the same distance in all meshes, as they would be in a single tree.
+    float rayRangeBias = KDTree::getRayRangeBias(nodes.at(0).bounds);
+    unsigned int loadedCnt = 0;
+    for (std::unique_ptr<KDTree> &tree : trees) {
+        tree->setRayRangeBias(rayRangeBias);
+        loadedCnt += tree->isLoadedFromCache();
+    }
+    std::cerr << meshTrees.size() << " meshes, " << trees.size() << " distinct trees";
+    if (!cachePathPrefix.empty())
+        std::cerr << ", " << loadedCnt << " loaded from \"" << cachePathPrefix << "*\"";
+    std::cerr << ", ray range bias: " << rayRangeBias << '\n';
+}
+
+void TwoLevelKDTree::buildTopLevel(std::vector<unsigned int> &meshesIndices, unsigned int begin,
+                                   unsigned int end, unsigned int depth) {
+    assert(depth <= maxTopLevelDepth);
+    unsigned int nodeIdx = nodes.size();
+    nodes.push_back({meshTrees.at(meshesIndices.at(begin)).tree->getSpaceBounds(), ~0u, 0});
+    for (unsigned int i = begin + 1; i < end; i++)
+        nodes.at(nodeIdx).bounds += meshTrees.at(meshesIndices.at(i)).tree->getSpaceBounds();
+    if (end - begin == 1) {
+        nodes.at(nodeIdx).meshIdx = meshesIndices.at(begin);
+        return;
+    }
+
+    BBox centers;
+    auto center = [&](unsigned int meshIdx, unsigned int axis) {
+        const glm::vec2 &bounds = meshTrees.at(meshIdx).tree->getSpaceBounds().axesBounds[axis];
+        return (bounds[0] + bounds[1]) / 2.f;
+    };
+    for (unsigned int axis = 0; axis < 3; axis++) {
+        centers.axesBounds[axis] = glm::vec2(center(meshesIndices.at(begin), axis));
+        for (unsigned int i = begin + 1; i < end; i++) {
+            float c = center(meshesIndices.at(i), axis);
+            centers.axesBounds[axis] = {std::min(centers.axesBounds[axis][0], c),
+                                        std::max(centers.axesBounds[axis][1], c)};
+        }
+    }
+    unsigned int axis = std::max({0, 1, 2}, [&](unsigned int d1, unsigned int d2) {
+        return centers.dimLength(d1) < centers.dimLength(d2);
+    });
+    unsigned int mid = (begin + end) / 2;
+    std::nth_element(meshesIndices.begin() + begin, meshesIndices.begin() + mid,
+                     meshesIndices.begin() + end, [&](unsigned int m1, unsigned int m2) {
+                         return center(m1, axis) < center(m2, axis);
+                     });
+    buildTopLevel(meshesIndices, begin, mid, depth + 1);
+    nodes.at(nodeIdx).secondChild = nodes.size();
+    buildTopLevel(meshesIndices, mid, end, depth + 1);
+}
+
+bool TwoLevelKDTree::findNearestIntersection(const Ray &r, float &t, glm::vec3 &n,
+                                             unsigned int &trianIdx) const {
+    if (nodes.empty())
+        return false;
+    float tNearest = std::numeric_limits<float>::infinity();
+    bool hit = false;
+    // Nodes with parametric distances at which the ray enters them, the nearest on top.
+    std::pair<unsigned int, float> stack[maxTopLevelDepth + 1];
+    unsigned int stackSize = 0;
+    float tMin, tMax;
+    if (nodes.at(0).bounds.intersect(r, tMin, tMax))
+        stack[stackSize++] = {0, tMin};
+    while (stackSize > 0) {
+        auto [nodeIdx, tEntry] = stack[--stackSize];
+        if (tEntry > tNearest)
+            continue;
+        const TwoLevelKDTreeNode &node = nodes[nodeIdx];
+        if (node.meshIdx != ~0u) {
+            // Parts of the mesh beyond the nearest hit so far are skipped.
+            const MeshTree &meshTree = meshTrees[node.meshIdx];
+            Ray meshRay = r;
+            meshRay.tMax = std::min(r.tMax, tNearest);
+            float meshT;
+            glm::vec3 meshN;
+            unsigned int meshTrianIdx;
+            if (meshTree.tree->findNearestIntersection(meshRay, meshTree.triangles, vertices,
+                                                       meshT, meshN, meshTrianIdx) &&
+                meshT < tNearest) {
+                hit = true;
+                tNearest = meshT;
+                n = meshN;
+                trianIdx = meshTree.firstTriangleIdx + meshTrianIdx;
+            }
+            continue;
+        }
+        unsigned int children[2] = {nodeIdx + 1, node.secondChild};
+        float childrenTMin[2];
+        bool isChildHit[2] = {nodes[children[0]].bounds.intersect(r, childrenTMin[0], tMax),
+                              nodes[children[1]].bounds.intersect(r, childrenTMin[1], tMax)};
+        // The farther child is pushed first, so that the nearer one is visited first.
+        unsigned int nearer =
+            isChildHit[1] && (!isChildHit[0] || childrenTMin[1] < childrenTMin[0]);
+        for (unsigned int i : {1 - nearer, nearer})
+            if (isChildHit[i])
+                stack[stackSize++] = {children[i], childrenTMin[i]};
+    }
+    if (hit)
+        t = tNearest;
+    return hit;
+}
+
+bool TwoLevelKDTree::isObstructed(const Ray &r) const {
+    if (nodes.empty())
+        return false;
+    unsigned int stack[maxTopLevelDepth + 1] = {0}, stackSize = 1;
+    while (stackSize > 0) {
+        unsigned int nodeIdx = stack[--stackSize];
+        const TwoLevelKDTreeNode &node = nodes[nodeIdx];
+        float tMin, tMax;
+        if (!node.bounds.intersect(r, tMin, tMax))
+            continue;
+        if (node.meshIdx == ~0u) {
+            stack[stackSize++] = nodeIdx + 1;
+            stack[stackSize++] = node.secondChild;
+        } else if (meshTrees[node.meshIdx].tree->isObstructed(r))
+            return true;
+    }
+    return false;
+}
+
+void TwoLevelKDTree::printStats(std::ostream &os) const {
+    os << meshTrees.size() << " meshes, " << trees.size() << " distinct trees, " << nodes.size()
+       << " top-level nodes\n";
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "Accelerator.hpp"
+#include "BBox.hpp"
+#include "KDTree.hpp"
+#include "Mesh.hpp"
+#include "Ray.hpp"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Node of the top-level tree. Interior node's first child follows it and the second one is at
+ * secondChild.
+ */
+struct TwoLevelKDTreeNode {
+    BBox bounds;
+    /* ~0u for interior nodes. */
+    unsigned int meshIdx;
+    unsigned int secondChild;
+};
+
+/**
+ * @brief Acceleration structure made of a KDTree for every mesh, shared by meshes of the same
+ * geometry, and a bounding volume hierarchy over meshes' bounds. Trees of meshes are cached
+ * separately, so that only edited meshes are rebuilt, and the top level is cheap to rebuild.
+ */
+class TwoLevelKDTree : public Accelerator {
+public:
+    /* Median splits halve the number of meshes, so the top level of fewer than 2^32 meshes is
+     * at most this deep. Traversal stacks hold one more node. */
+    static constexpr unsigned int maxTopLevelDepth = 32;
+
+    /**
+     * @param params Parameters of meshes' trees, except for maxDepth, which is picked for each
+     * mesh by KDTreeParams::defaultMaxDepth.
+     * @param cachePathPrefix Tree of a mesh is cached in cachePathPrefix followed by the hash of
+     * its geometry in 16 hex digits, so that editing some meshes does not invalidate files of the
+     * others. Meshes of the same geometry share a tree and its file. Empty disables caching.
+     */
+    TwoLevelKDTree(const std::vector<Mesh> &meshes, const std::vector<Triangle> &triangles,
+                   const std::vector<Vertex> &vertices, const KDTreeParams &params,
+                   unsigned int buildThreads = 1, KDTreeBuild build = KDTreeBuild::SAH,
+                   const std::string &cachePathPrefix = "");
+    bool findNearestIntersection(const Ray &r, float &t, glm::vec3 &n,
+                                 unsigned int &trianIdx) const override;
+    bool isObstructed(const Ray &r) const override;
+    void printStats(std::ostream &os) const override;
+
+private:
+    /* Mesh's triangles, indexed by its tree. */
+    struct MeshTree {
+        unsigned int firstTriangleIdx;
+        std::vector<Triangle> triangles;
+        /* One of trees, shared by meshes of the same geometry. */
+        KDTree *tree;
+    };
+
+    const std::vector<Vertex> &vertices;
+    std::vector<MeshTree> meshTrees;
+    /* Trees of distinct geometries of meshes. */
+    std::vector<std::unique_ptr<KDTree>> trees;
+    /* Empty if there are no meshes. */
+    std::vector<TwoLevelKDTreeNode> nodes;
+
+    /**
+     * @brief Build the subtree of meshTrees[meshesIndices[begin..end)] split at the median of
+     * their bounds' centers along the longest axis.
+     * @param depth Depth of the subtree's root.
+     */
+    void buildTopLevel(std::vector<unsigned int> &meshesIndices, unsigned int begin,
+                       unsigned int end, unsigned int depth);
+};
@@ -0,0 +1,145 @@
+#include "WideBVH.hpp"
+#include "WideBVHTraversal.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+/* Rounding errors must not make rays miss boxes they graze, see BVH::intersectBounds. */
+static constexpr float boundsTolerance = 1.f + 3.f * std::numeric_limits<float>::epsilon();
+
+WideBVH::WideBVH(const std::vector<Triangle> &triangles, const std::vector<Vertex> &vertices,
+                 BVHBuild build, unsigned int buildThreads)
+    : triangles(triangles), vertices(vertices), rayRangeBias(0.f) {
+    if (triangles.empty())
+        return;
+    BVH binary(triangles, vertices, build, buildThreads);
+    leavesBlocks = std::move(binary.leavesBlocks);
+    rayRangeBias = binary.rayRangeBias;
+    collapse(binary, 0);
+    nodes.shrink_to_fit();
+}
+
+unsigned int WideBVH::collapse(const BVH &binary, unsigned int nodeIdx) {
+    // Open the child of the largest surface area until there are width children, so that the
+    // children are as likely to be hit as possible.
+    const BVHNode &node = binary.nodes.at(nodeIdx);
+    std::vector<unsigned int> children;
+    if (node.trianglesCnt > 0)
+        children = {nodeIdx};
+    else
+        children = {nodeIdx + 1, node.offset};
+    while (children.size() < WideBVHNode::width) {
+        auto largest = children.end();
+        for (auto child = children.begin(); child != children.end(); child++)
+            if (binary.nodes.at(*child).trianglesCnt == 0 &&
+                (largest == children.end() || binary.nodes.at(*child).bounds.surfaceArea() >
+                                                  binary.nodes.at(*largest).bounds.surfaceArea()))
+                largest = child;
+        if (largest == children.end())
+            break;
+        unsigned int opened = *largest;
+        *largest = opened + 1;
+        children.push_back(binary.nodes.at(opened).offset);
+    }
+
+    unsigned int wideIdx = nodes.size();
+    nodes.emplace_back();
+    for (unsigned int i = 0; i < WideBVHNode::width; i++) {
+        for (unsigned int axis = 0; axis < 3; axis++) {
+            nodes.at(wideIdx).bounds[0][axis][i] = std::numeric_limits<float>::infinity();
+            nodes.at(wideIdx).bounds[1][axis][i] = -std::numeric_limits<float>::infinity();
+        }
+        nodes.at(wideIdx).children[i] = 0;
+        nodes.at(wideIdx).blocksCnts[i] = 0;
+    }
+    for (unsigned int i = 0; i < children.size(); i++) {
+        const BVHNode &child = binary.nodes.at(children.at(i));
+        for (unsigned int axis = 0; axis < 3; axis++) {
+            nodes.at(wideIdx).bounds[0][axis][i] = child.bounds.axesBounds.at(axis)[0];
+            nodes.at(wideIdx).bounds[1][axis][i] = child.bounds.axesBounds.at(axis)[1];
+        }
+        if (child.trianglesCnt > 0) {
+            nodes.at(wideIdx).children[i] = child.offset;
+            nodes.at(wideIdx).blocksCnts[i] = BVH::blocksCnt(child.trianglesCnt);
+        } else {
+            unsigned int childIdx = collapse(binary, children.at(i));
+            nodes.at(wideIdx).children[i] = childIdx;
+        }
+    }
+    return wideIdx;
+}
+
+int WideBVHNode::intersectChildren(const glm::vec3 &o, const glm::vec3 &invD, float tMin,
+                                   float tMax, float *tMins) const {
+#ifdef SIMD_AVAILABLE
+    vfloat tNear = vset1(tMin), tFar = vset1(tMax);
+    for (unsigned int axis = 0; axis < 3; axis++) {
+        // Bounds the ray enters and leaves the children's slabs through.
+        bool negative = invD[axis] < 0.f;
+        vfloat oAxis = vset1(o[axis]), invDAxis = vset1(invD[axis]);
+        vfloat t0 = vmul(vsub(vload(bounds[negative][axis]), oAxis), invDAxis),
+               t1 = vmul(vsub(vload(bounds[!negative][axis]), oAxis), invDAxis);
+        // NaNs, from rays lying in children's faces, leave the ranges unchanged, as min and max
+        // return their second operand then.
+        tNear = vmax(t0, tNear);
+        tFar = vmin(vmul(t1, vset1(boundsTolerance)), tFar);
+    }
+    vstore(tMins, tNear);
+    return vmask(vle(tNear, tFar));
+#else
+    int mask = 0;
+    for (unsigned int i = 0; i < width; i++) {
+        float tNear = tMin, tFar = tMax;
+        for (unsigned int axis = 0; axis < 3; axis++) {
+            bool negative = invD[axis] < 0.f;
+            float t0 = (bounds[negative][axis][i] - o[axis]) * invD[axis],
+                  t1 = (bounds[!negative][axis][i] - o[axis]) * invD[axis] * boundsTolerance;
+            tNear = t0 > tNear ? t0 : tNear;
+            tFar = t1 < tFar ? t1 : tFar;
+        }
+        tMins[i] = tNear;
+        mask |= (tNear <= tFar) << i;
+    }
+    return mask;
+#endif // SIMD_AVAILABLE
+}
+
+bool WideBVHNode::isInterior(unsigned int i) const { return blocksCnts[i] == 0; }
+
+unsigned int WideBVHNode::interiorChild(unsigned int i) const { return children[i]; }
+
+unsigned int WideBVHNode::leafFirstBlock(unsigned int i) const { return children[i]; }
+
+unsigned int WideBVHNode::leafBlocksCnt(unsigned int i) const { return blocksCnts[i]; }
+
+bool WideBVH::findNearestIntersection(const Ray &r, float &t, glm::vec3 &n,
+                                      unsigned int &trianIdx) const {
+    if (nodes.empty())
+        return false;
+    return WideBVHTraversal<WideBVHNode>::findNearestIntersection(
+        nodes.data(), leavesBlocks.data(), triangles, vertices, rayRangeBias, r, t, n, trianIdx);
+}
+
+bool WideBVH::isObstructed(const Ray &r) const {
+    if (nodes.empty())
+        return false;
+    return WideBVHTraversal<WideBVHNode>::isObstructed(nodes.data(), leavesBlocks.data(),
+                                                       rayRangeBias, r);
+}
+
+void WideBVH::printStats(std::ostream &os) const {
+    unsigned int childrenCnt = 0, leavesCnt = 0;
+    for (const WideBVHNode &node : nodes)
+        for (unsigned int i = 0; i < WideBVHNode::width; i++) {
+            bool used = node.bounds[0][0][i] <= node.bounds[1][0][i];
+            childrenCnt += used;
+            leavesCnt += used && node.blocksCnts[i] > 0;
+        }
+    os << "Nodes: " << nodes.size() << " of width " << WideBVHNode::width << ", children per node: "
+       << (double)childrenCnt / std::max<std::size_t>(1, nodes.size()) << ", leaves: " << leavesCnt
+       << '\n'
+       << "Memory: nodes " << nodes.capacity() * sizeof(WideBVHNode) / 1024.
+       << " KiB, leaves' blocks " << leavesBlocks.capacity() * sizeof(TriangleBlock) / 1024.
+       << " KiB\n";
+}
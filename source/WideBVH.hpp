@@ -0,0 +1,80 @@
+#pragma once
+
+#include "Accelerator.hpp"
+#include "AlignedAllocator.hpp"
+#include "BVH.hpp"
+#include "Mesh.hpp"
+#include "SIMD.hpp"
+#include "TriangleBlock.hpp"
+
+#include <cstdint>
+#include <vector>
+
+/**
+ * Node of WideBVH with bounds of its children in SoA layout, so that a single SIMD test checks
+ * the ray against all of them.
+ */
+struct alignas(32) WideBVHNode {
+    static constexpr unsigned int width = simdWidth;
+
+    /* Lower (bounds[0]) and upper (bounds[1]) bounds along each axis of each child. Unused
+     * children have lower bounds of infinity and upper bounds of minus infinity, so they are
+     * never hit. */
+    float bounds[2][3][width];
+    /* Index of the child node, of the first of child's blocks for leaves. */
+    unsigned int children[width];
+    /* Number of child's blocks for leaves, 0 for interior and unused children. */
+    std::uint8_t blocksCnts[width];
+
+    /**
+     * @brief Test the ray against all children of the node.
+     * @param tMins Set to parametric distances at which the ray enters hit children.
+     * @return Mask of children hit with t in [tMin, tMax].
+     */
+    int intersectChildren(const glm::vec3 &o, const glm::vec3 &invD, float tMin, float tMax,
+                          float *tMins) const;
+    bool isInterior(unsigned int i) const;
+    unsigned int interiorChild(unsigned int i) const;
+    unsigned int leafFirstBlock(unsigned int i) const;
+    unsigned int leafBlocksCnt(unsigned int i) const;
+};
+
+/**
+ * @brief Bounding volume hierarchy with WideBVHNode::width children per node, i.e. BVH4 when built
+ * with SSE and BVH8 with AVX. Made by collapsing a BVH, each node adopting children of its
+ * largest children until it has width of them.
+ */
+class WideBVH : public Accelerator {
+public:
+    static constexpr unsigned int cacheLineSize = 64;
+
+    /**
+     * @param build How the collapsed BVH is built.
+     * @param buildThreads See BVH::BVH.
+     */
+    WideBVH(const std::vector<Triangle> &triangles, const std::vector<Vertex> &vertices,
+            BVHBuild build = BVHBuild::SAH, unsigned int buildThreads = 1);
+    bool findNearestIntersection(const Ray &r, float &t, glm::vec3 &n,
+                                 unsigned int &trianIdx) const override;
+    bool isObstructed(const Ray &r) const override;
+    void printStats(std::ostream &os) const override;
+
+private:
+    /* Made by quantizing WideBVH. */
+    friend class QuantizedWideBVH;
+
+    const std::vector<Triangle> &triangles;
+    const std::vector<Vertex> &vertices;
+    /* Empty if there are no triangles. */
+    std::vector<WideBVHNode, AlignedAllocator<WideBVHNode, cacheLineSize>> nodes;
+    /* Blocks of BVH's leaves, which become children of nodes. */
+    std::vector<TriangleBlock> leavesBlocks;
+    /* See KDTree::getRayRangeBias. */
+    float rayRangeBias;
+
+    /**
+     * @brief Make a node of the subtree of binary node nodeIdx.
+     * @return Index of the made node.
+     */
+    unsigned int collapse(const BVH &binary, unsigned int nodeIdx);
+};
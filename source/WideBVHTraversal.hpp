@@ -0,0 +1,136 @@
+#pragma once
+
+#include "BVH.hpp"
+#include "Mesh.hpp"
+#include "Ray.hpp"
+#include "TriangleBlock.hpp"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Traversal of hierarchies with Node::width children per node, shared by WideBVH and
+ * QuantizedWideBVH, which differ only in how nodes store their children. Node has to provide:
+ * - int intersectChildren(o, invD, tMin, tMax, tMins) const, see WideBVHNode::intersectChildren,
+ * - bool isInterior(i) const and unsigned int interiorChild(i) const, index of interior child i,
+ * - unsigned int leafFirstBlock(i) const and leafBlocksCnt(i) const of leaf child i.
+ * Root is the first node of the hierarchy, which must not be empty.
+ */
+template <typename Node> struct WideBVHTraversal {
+    /* Upper bound for the number of nodes waiting on traversal stack. */
+    static constexpr unsigned int maxTodo = BVH::maxDepth * (Node::width - 1) + 1;
+
+    /**
+     * @brief See Accelerator::findNearestIntersection.
+     * @param rayRangeBias See KDTree::getRayRangeBias.
+     */
+    static bool findNearestIntersection(const Node *nodes, const TriangleBlock *leavesBlocks,
+                                        const std::vector<Triangle> &triangles,
+                                        const std::vector<Vertex> &vertices, float rayRangeBias,
+                                        const Ray &r, float &t, glm::vec3 &n,
+                                        unsigned int &trianIdx);
+    /**
+     * @brief See Accelerator::isObstructed.
+     */
+    static bool isObstructed(const Node *nodes, const TriangleBlock *leavesBlocks,
+                             float rayRangeBias, const Ray &r);
+};
+
+template <typename Node>
+bool WideBVHTraversal<Node>::findNearestIntersection(const Node *nodes,
+                                                     const TriangleBlock *leavesBlocks,
+                                                     const std::vector<Triangle> &triangles,
+                                                     const std::vector<Vertex> &vertices,
+                                                     float rayRangeBias, const Ray &r, float &t,
+                                                     glm::vec3 &n, unsigned int &trianIdx) {
+    // Offset the same as in KDTree, so that both find the same hits.
+    glm::vec3 o = r.o + r.d * rayRangeBias;
+    glm::vec3 invD = 1.f / r.d;
+    float tMin = r.tMin - rayRangeBias, tNearest = r.tMax;
+    glm::vec2 baryPos;
+    bool hit = false;
+
+    // Nodes with parametric distances at which the ray enters them, the nearest on top.
+    std::pair<unsigned int, float> stack[maxTodo];
+    unsigned int stackSize = 0, nodeIdx = 0;
+    alignas(32) float tMins[Node::width];
+    while (true) {
+        const Node &node = nodes[nodeIdx];
+        int mask = node.intersectChildren(o, invD, tMin, tNearest, tMins);
+        // Leaves are tested right away, interior children are visited nearest first.
+        std::pair<unsigned int, float> hitChildren[Node::width];
+        unsigned int hitChildrenCnt = 0;
+        for (; mask != 0; mask &= mask - 1) {
+            unsigned int i = __builtin_ctz(mask);
+            if (node.isInterior(i)) {
+                hitChildren[hitChildrenCnt++] = {node.interiorChild(i), tMins[i]};
+                continue;
+            }
+            unsigned int firstBlock = node.leafFirstBlock(i);
+            for (unsigned int j = firstBlock; j < firstBlock + node.leafBlocksCnt(i); j++) {
+                glm::vec2 blockBaryPos;
+                int lane = leavesBlocks[j].intersectNearest(o, r.d, tMin, tNearest, blockBaryPos);
+                if (lane >= 0) {
+                    hit = true;
+                    trianIdx = leavesBlocks[j].trianIdx[lane];
+                    baryPos = blockBaryPos;
+                }
+            }
+        }
+        std::sort(hitChildren, hitChildren + hitChildrenCnt,
+                  [](const std::pair<unsigned int, float> &c1,
+                     const std::pair<unsigned int, float> &c2) { return c1.second > c2.second; });
+        for (unsigned int i = 0; i < hitChildrenCnt; i++)
+            stack[stackSize++] = hitChildren[i];
+
+        // Nodes entered beyond the nearest hit so far are skipped.
+        while (stackSize > 0 && stack[stackSize - 1].second > tNearest)
+            stackSize--;
+        if (stackSize == 0)
+            break;
+        nodeIdx = stack[--stackSize].first;
+    }
+
+    if (!hit)
+        return false;
+    t = tNearest;
+    const Triangle &tri = triangles[trianIdx];
+    const Vertex &a = vertices[tri.indices[0]];
+    const Vertex &b = vertices[tri.indices[1]];
+    const Vertex &c = vertices[tri.indices[2]];
+    n = glm::normalize(a.norm + baryPos.x * (b.norm - a.norm) + baryPos.y * (c.norm - a.norm));
+    return true;
+}
+
+template <typename Node>
+bool WideBVHTraversal<Node>::isObstructed(const Node *nodes, const TriangleBlock *leavesBlocks,
+                                          float rayRangeBias, const Ray &r) {
+    // Surfaces at both ends of the segment must not obstruct it.
+    float tMin = r.tMin + 2.f * rayRangeBias, tMax = r.tMax - 2.f * rayRangeBias;
+    glm::vec3 invD = 1.f / r.d;
+
+    unsigned int stack[maxTodo];
+    unsigned int stackSize = 0, nodeIdx = 0;
+    alignas(32) float tMins[Node::width];
+    while (true) {
+        const Node &node = nodes[nodeIdx];
+        for (int mask = node.intersectChildren(r.o, invD, tMin, tMax, tMins); mask != 0;
+             mask &= mask - 1) {
+            unsigned int i = __builtin_ctz(mask);
+            if (node.isInterior(i)) {
+                stack[stackSize++] = node.interiorChild(i);
+                continue;
+            }
+            unsigned int firstBlock = node.leafFirstBlock(i);
+            for (unsigned int j = firstBlock; j < firstBlock + node.leafBlocksCnt(i); j++)
+                if (leavesBlocks[j].intersectAny(r.o, r.d, tMin, tMax))
+                    return true;
+        }
+        if (stackSize == 0)
+            return false;
+        nodeIdx = stack[--stackSize];
+    }
+}
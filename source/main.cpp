@@ -20,9 +20,43 @@ int main(int argc, const char *argv[]) {
     desc.add_options()
         ("help,h", po::bool_switch(), "Print this help message.")
         ("threads,n", po::value<int>()->default_value(-1),
-         "Number of threads used for rendering. -1 (default) means number of available CPU "
-         "cores.")
+         "Number of threads used for building acceleration structure and rendering. -1 "
+         "(default) means number of available CPU cores.")
+        ("binned-sah", po::bool_switch(),
+         "Build acceleration structure using SAH evaluated at a fixed number of bins. It is built "
+         "faster, but rendering is slower, which pays off for quick low sample renders.")
+        ("accel-stats", po::bool_switch(),
+         "Print a summary of acceleration structure quality and memory footprint after building "
+         "it.")
+        ("accel", po::value<std::string>()->default_value("kdtree"),
+         "Acceleration structure: 'kdtree', 'two-level' for a k-d tree for every mesh and one "
+         "over meshes, so that only meshes changed since an earlier run have to be rebuilt, or "
+         "'bvh' for a bounding volume hierarchy, which builds faster, 'wide-bvh' for one with 4 "
+         "(SSE) or 8 (AVX) children per node tested at once, or 'quantized-bvh' for 'wide-bvh' "
+         "with children's bounds stored in bytes, whose nodes take a third to two fifths of the "
+         "memory, which pays off for scenes too large for cache. Autotuning always uses "
+         "'kdtree'.")
+        ("bvh-build", po::value<std::string>()->default_value("sah"),
+         "How 'bvh', 'wide-bvh' and 'quantized-bvh' are built: 'sah', 'lbvh' from Morton codes of "
+         "triangles on all threads, which is several times faster, but renders slower, 'hlbvh', "
+         "which also rebuilds the top levels of 'lbvh' with SAH, or 'sbvh', which splits large "
+         "triangles between nodes like the k-d tree does and renders faster at the cost of memory.")
+        ("ray-weighted", po::bool_switch(),
+         "Trace a few rays through a quickly built acceleration structure and fit the final one to "
+         "where they hit the scene. Used only with --accel kdtree without --binned-sah.")
+        ("no-accel-cache", po::bool_switch(),
+         "Always build acceleration structure. By default it is loaded from OBJ_FILE.kdtree saved "
+         "by an earlier run for the same scene and build options, and saved there otherwise. "
+         "'two-level' instead saves the tree of each mesh in OBJ_FILE.kdtree.HASH, where HASH "
+         "identifies mesh's geometry. Files of edited or removed meshes are never deleted.")
         ("samples,s", po::value<unsigned int>()->default_value(1024), "Number of samples per pixel.")
+        ("benchmark,b", po::bool_switch(),
+         "Measure acceleration structure performance on rays sampled from the scene instead of "
+         "rendering.")
+        ("autotune", po::bool_switch(),
+         "Find acceleration structure parameters giving the fastest rendering of rays sampled from "
+         "the scene and save them to OBJ_FILE.kdparams, which is read by later runs, instead of "
+         "rendering.")
         ("preview,p", po::bool_switch(),
          "Preview scene.\n"
          "Controls:\n"
@@ -55,10 +89,49 @@ int main(int argc, const char *argv[]) {
     }
 
     RenderingTask rt(vm.at("rtc_file").as<std::string>(), vm.at("samples").as<unsigned int>(), vm.at("threads").as<int>());
+    KDTreeBuild build = vm.at("binned-sah").as<bool>() ? KDTreeBuild::BinnedSAH : KDTreeBuild::SAH;
+    bool useCache = !vm.at("no-accel-cache").as<bool>();
+    rt.printAccStats = vm.at("accel-stats").as<bool>();
+    rt.rayWeightedAcc = vm.at("ray-weighted").as<bool>();
+    std::string accel = vm.at("accel").as<std::string>();
+    if (accel == "two-level")
+        rt.accType = AcceleratorType::TwoLevelKDTree;
+    else if (accel == "bvh")
+        rt.accType = AcceleratorType::BVH;
+    else if (accel == "wide-bvh")
+        rt.accType = AcceleratorType::WideBVH;
+    else if (accel == "quantized-bvh")
+        rt.accType = AcceleratorType::QuantizedWideBVH;
+    else if (accel != "kdtree") {
+        std::cerr << "Unknown acceleration structure '" << accel << "'.\n";
+        return 1;
+    }
+    std::string bvhBuild = vm.at("bvh-build").as<std::string>();
+    if (bvhBuild == "lbvh")
+        rt.bvhBuild = BVHBuild::LBVH;
+    else if (bvhBuild == "hlbvh")
+        rt.bvhBuild = BVHBuild::HLBVH;
+    else if (bvhBuild == "sbvh")
+        rt.bvhBuild = BVHBuild::SBVH;
+    else if (bvhBuild != "sah") {
+        std::cerr << "Unknown BVH build '" << bvhBuild << "'.\n";
+        return 1;
+    }
+    if (vm.at("autotune").as<bool>()) {
+        rt.accType = AcceleratorType::KDTree;
+        rt.buildAccStructures(build, useCache);
+        rt.autotune(build);
+        return 0;
+    }
+    if (vm.at("benchmark").as<bool>()) {
+        rt.buildAccStructures(build, useCache);
+        rt.benchmark();
+        return 0;
+    }
     if (vm.at("preview").as<bool>())
         rt.preview();
     if (rt.renderPreview || !vm.at("preview").as<bool>()) {
-        rt.buildAccStructures();
+        rt.buildAccStructures(build, useCache);
         rt.render();
     }
     return 0;
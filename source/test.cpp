@@ -1,3 +1,4 @@
+#include "BBox.hpp"
 #include "HemisphereSampler.hpp"
 #include "Mesh.hpp"
 #include "utils.hpp"
@@ -40,4 +41,14 @@ int main() {
     std::vector<Vertex> vertices{{{0, 0, 0}}, {{1, 0, 0}}, {{0, 1, 0}}};
     Triangle trian = {{0, 1, 2}};
     std::cout << trian.area(vertices) << '\n';
+    std::cout << '\n';
+
+    std::cout << "Bounds of triangle clipped to box" << '\n';
+    BBox clipped;
+    bool overlaps = BBox(glm::vec2(.5f, 1.f), glm::vec2(0.f, 1.f), glm::vec2(-1.f, 1.f))
+                        .clipTriangle(trian, vertices, clipped);
+    std::cout << overlaps << '\n';
+    // expected: [.5, 1] x [0, .5] x [0, 0]
+    for (unsigned int axis = 0; axis < 3; axis++)
+        std::cout << clipped.axesBounds[axis][0] << ' ' << clipped.axesBounds[axis][1] << '\n';
 }